@@ -1,226 +1,3064 @@
+/* jpm builds with -std=c99, under which the POSIX parts of the C library,
+ * such as strdup, are not declared unless asked for before any header */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
 #include <janet.h>
 #include "mongoose.h"
 #include <stdio.h>
 
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#endif
+
+#if defined(TCP_CORK)
+#define CIRCLET_TCP_CORK TCP_CORK
+#elif defined(TCP_NOPUSH)
+#define CIRCLET_TCP_CORK TCP_NOPUSH
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#define CIRCLET_INOTIFY 1
+#endif
+
+#ifndef CIRCLET_ENABLE_ZLIB
+#ifdef _WIN32
+#define CIRCLET_ENABLE_ZLIB 0
+#else
+#define CIRCLET_ENABLE_ZLIB 1
+#endif
+#endif
+
+#if CIRCLET_ENABLE_ZLIB
+#include <zlib.h>
+#endif
+
+/* Longest cache key we will build on the stack */
+#define CIRCLET_MAX_KEY 1024
+
+/* A websocket frame, header and payload, encoded once and shared by every
+ * connection it is queued on. Freed when the last of them lets go. */
+typedef struct {
+    size_t refcount;
+    size_t len;
+    unsigned char data[];
+} WsFrame;
+
+/* Most queued websocket frames handed to the socket in one writev */
+#define CIRCLET_WS_IOV 64
+
+/* Frames waiting to be written to a websocket connection, as a ring. The
+ * first frame is always whole; a partly written frame is moved to send_mbuf. */
 typedef struct {
+    WsFrame **frames;
+    size_t head;
+    size_t count;
+    size_t capacity;
+    size_t bytes;
+} WsQueue;
+
+/* Every accepted connection gets a wrapper of its own, sharing the handler
+ * fiber of its listener. conn is cleared when the connection closes.
+ * nodelay, cork, ws_stream, ws_max_message and the keepalive times come from
+ * the bind options of the listener. A streamed websocket message in progress
+ * is kept as the flags of its first frame in ws_message, and its size so far.
+ * ws_last_seen is when the peer last sent anything, and ws_ping_sent when
+ * the keepalive ping it has yet to answer went out. With a ws_handler, each
+ * websocket connection runs it in a ws_fiber of its own. ws_state is a value
+ * Janet code keeps with the connection until it closes. A connection with
+ * coalesced frames still to write is on the ws_pending list of its manager. */
+typedef struct ConnectionWrapper {
     struct mg_connection *conn;
     JanetFiber *fiber;
+    JanetFunction *on_writable;
+    int nodelay;
+    int cork;
+    WsQueue ws_queue;
+    struct WsMember *topics;
+    int ws_flags;
+    int ws_stream;
+    size_t ws_max_message;
+    int ws_message;
+    size_t ws_message_size;
+    unsigned long ws_dropped;
+    double ws_ping_interval;
+    double ws_pong_timeout;
+    double ws_last_seen;
+    double ws_ping_sent;
+    JanetFunction *ws_handler;
+    JanetFiber *ws_fiber;
+    Janet ws_state;
+    int ws_pending;
+    struct ConnectionWrapper *ws_pending_prev;
+    struct ConnectionWrapper *ws_pending_next;
+#if CIRCLET_ENABLE_ZLIB
+    z_stream *ws_inflater;
+#endif
 } ConnectionWrapper;
 
-static int connection_mark(void *p, size_t size) {
-    (void) size;
-    ConnectionWrapper *cw = (ConnectionWrapper *)p;
-    struct mg_connection *conn = cw->conn;
-    JanetFiber *fiber = cw->fiber;
-    janet_mark(janet_wrap_fiber(fiber));
-    janet_mark(janet_wrap_abstract(conn->mgr));
-    return 0;
+/* Set on connections whose priv_2 is a Stream. mongoose only uses priv_2
+ * for outgoing and MQTT connections. */
+#define CIRCLET_F_STREAM MG_F_USER_1
+
+/* A response body resumed from a fiber one chunk at a time */
+typedef struct {
+    JanetFiber *fiber;
+    int chunked;
+} Stream;
+
+/* Set on connections whose priv_2 is an SseSubscriber */
+#define CIRCLET_F_SSE MG_F_USER_2
+
+/* Set while a connection is corked until its send buffer drains */
+#define CIRCLET_F_CORKED MG_F_USER_3
+
+/* A small string keyed hash map. Nodes are embedded in the structures that
+ * own them, so lookups never allocate. */
+typedef struct MapNode {
+    struct MapNode *next;
+    char *key;
+    size_t keylen;
+    uint32_t hash;
+} MapNode;
+
+typedef struct {
+    MapNode **buckets;
+    size_t capacity;
+    size_t count;
+} Map;
+
+static uint32_t map_hash(const char *key, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) key[i];
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
-static struct JanetAbstractType Connection_jt = {
-    "mongoose.connection",
-    NULL,
-    connection_mark,
-#ifdef JANET_ATEND_GCMARK
-    JANET_ATEND_GCMARK
-#endif
+static MapNode *map_find(Map *map, const char *key, size_t len) {
+    if (!map->capacity) return NULL;
+    uint32_t hash = map_hash(key, len);
+    MapNode *node = map->buckets[hash & (map->capacity - 1)];
+    while (node) {
+        if (node->hash == hash && node->keylen == len && !memcmp(node->key, key, len))
+            return node;
+        node = node->next;
+    }
+    return NULL;
+}
+
+/* Insert a node whose key is already set. The key must not be present. */
+static void map_insert(Map *map, MapNode *node) {
+    if (map->count >= map->capacity) {
+        size_t newcap = map->capacity ? map->capacity * 2 : 16;
+        MapNode **buckets = calloc(newcap, sizeof(MapNode *));
+        if (buckets) {
+            for (size_t i = 0; i < map->capacity; i++) {
+                MapNode *n = map->buckets[i];
+                while (n) {
+                    MapNode *next = n->next;
+                    n->next = buckets[n->hash & (newcap - 1)];
+                    buckets[n->hash & (newcap - 1)] = n;
+                    n = next;
+                }
+            }
+            free(map->buckets);
+            map->buckets = buckets;
+            map->capacity = newcap;
+        } else if (!map->capacity) {
+            JANET_OUT_OF_MEMORY;
+        }
+    }
+    node->hash = map_hash(node->key, node->keylen);
+    MapNode **bucket = map->buckets + (node->hash & (map->capacity - 1));
+    node->next = *bucket;
+    *bucket = node;
+    map->count++;
+}
+
+static void map_remove(Map *map, MapNode *node) {
+    MapNode **at = map->buckets + (node->hash & (map->capacity - 1));
+    while (*at) {
+        if (*at == node) {
+            *at = node->next;
+            map->count--;
+            return;
+        }
+        at = &(*at)->next;
+    }
+}
+
+static void map_deinit(Map *map) {
+    free(map->buckets);
+    map->buckets = NULL;
+    map->capacity = 0;
+    map->count = 0;
+}
+
+/* In-memory cache of small files served with :file and :static. Each
+ * entry holds a complete prebuilt response (headers followed by body),
+ * so a hit is a single append to the send buffer. Entries are validated
+ * with inotify where available, and by re-checking mtime and size at most
+ * once per ttl otherwise. The same structure holds compressed response
+ * bodies, which are looked up without any validation. */
+typedef struct CacheEntry {
+    MapNode node;
+    struct CacheEntry *prev, *next;
+    char *data;
+    size_t len;
+    size_t header_len;
+    size_t cost;
+    time_t mtime;
+    char etag[64];
+    double validated;
+    struct CacheWatch *watch;
+    struct CacheEntry *watch_prev, *watch_next;
+} CacheEntry;
+
+/* The entries of a cache that share one inotify watch. The kernel hands out
+ * one watch per inode, so it is kept until the last of them goes. Watches
+ * are keyed by their descriptor. */
+typedef struct CacheWatch {
+    MapNode node;
+    int wd;
+    CacheEntry *entries;
+} CacheWatch;
+
+typedef struct {
+    Map map;
+    Map watches;
+    CacheEntry *head, *tail;
+    size_t used;
+    size_t budget;
+    size_t max_entry;
+    double ttl;
+    int inotify_fd;
+    unsigned long drained;
+} FileCache;
+
+/* Startup-time index of a static root, mapping each normalized URI path
+ * to what it resolves to. Directories are keyed with a trailing slash. */
+enum {
+    INDEX_FILE,
+    INDEX_PASSTHROUGH
 };
 
-static int manager_gc(void *p, size_t size) {
-    (void) size;
-    mg_mgr_free((struct mg_mgr *) p);
-    return 0;
+typedef struct IndexEntry {
+    MapNode node;
+    struct IndexEntry *all, *all_prev;
+    char *path;
+    uint64_t ino;
+    int64_t size;
+    time_t mtime;
+    int kind;
+    int has_gz;
+    uint64_t gz_ino;
+    int64_t gz_size;
+    time_t gz_mtime;
+} IndexEntry;
+
+/* A watched directory of a static index. inotify names the directory of
+ * an event by its watch descriptor, which is shared by every path that
+ * leads to the same directory. */
+typedef struct IndexDir {
+    struct IndexDir *next;
+    char *local;
+    char *uri;
+    size_t locallen;
+    size_t urilen;
+    int wd;
+    int depth;
+    int protected;
+    unsigned long seen;
+} IndexDir;
+
+typedef struct StaticIndex {
+    struct StaticIndex *next;
+    char *root;
+    Map map;
+    IndexEntry *entries;
+    IndexDir *dirs;
+    unsigned long events;
+    int inotify_fd;
+    int dirty;
+    int precompressed;
+    unsigned long drained;
+} StaticIndex;
+
+#if CIRCLET_ENABLE_ZLIB
+/* A buffer reused by every websocket message that gets compressed or
+ * inflated */
+typedef struct {
+    unsigned char *data;
+    size_t size;
+} WsScratch;
+#endif
+
+typedef struct {
+    struct mg_mgr mgr;
+    unsigned long generation;
+    FileCache file_cache;
+    FileCache compress_cache;
+    int compress;
+    int compress_level;
+    size_t compress_min_size;
+    StaticIndex *indexes;
+    Map path_info;
+    struct PathInfo *path_infos;
+    int precompressed;
+    Map validators;
+    struct Validator *validator_head, *validator_tail;
+    double validator_ttl;
+    Map sse_channels;
+    Map ws_topics;
+    int ws_deflate;
+    int ws_no_context_takeover;
+    size_t ws_deflate_min_size;
+    size_t ws_queue_bytes;
+    size_t ws_queue_messages;
+    int ws_queue_policy;
+    unsigned long ws_dropped;
+    unsigned long ws_evicted;
+    unsigned long ws_timed_out;
+    int ws_coalesce;
+    ConnectionWrapper *ws_pending;
+    uint8_t *ws_separator;
+    size_t ws_separator_len;
+#if CIRCLET_ENABLE_ZLIB
+    z_stream *ws_deflater;
+    z_stream *ws_inflater;
+    WsScratch ws_deflated;
+    WsScratch ws_inflated;
+#endif
+    size_t send_high_water;
+    size_t send_low_water;
+    time_t date_time;
+    size_t date_len;
+    char date[80];
+} Manager;
+
+/* Options are passed as an optional table or struct */
+static Janet option(Janet opts, const char *name) {
+    const JanetKV *kvs;
+    int32_t len, cap;
+    if (janet_checktype(opts, JANET_NIL)) return janet_wrap_nil();
+    if (!janet_dictionary_view(opts, &kvs, &len, &cap))
+        janet_panicf("expected table or struct of options, got %v", opts);
+    return janet_dictionary_get(kvs, cap, janet_ckeywordv(name));
 }
 
-static int manager_mark(void *p, size_t size) {
-    (void) size;
-    struct mg_mgr *mgr = (struct mg_mgr *)p;
-    /* Iterate all connections, and mark then */
-    struct mg_connection *conn = mgr->active_connections;
-    while (conn) {
-        ConnectionWrapper *cw = conn->user_data;
-        if (cw) {
-            janet_mark(janet_wrap_abstract(cw));
+static double option_number(Janet opts, const char *name, double dflt) {
+    Janet x = option(opts, name);
+    if (janet_checktype(x, JANET_NIL)) return dflt;
+    if (!janet_checktype(x, JANET_NUMBER))
+        janet_panicf("expected number for option :%s, got %v", name, x);
+    return janet_unwrap_number(x);
+}
+
+static size_t option_size(Janet opts, const char *name, size_t dflt) {
+    Janet x = option(opts, name);
+    if (janet_checktype(x, JANET_NIL)) return dflt;
+    if (!janet_checksize(x))
+        janet_panicf("expected non-negative integer for option :%s, got %v", name, x);
+    return (size_t) janet_unwrap_number(x);
+}
+
+static int option_int(Janet opts, const char *name, int dflt) {
+    size_t x = option_size(opts, name, (size_t) dflt);
+    if (x > INT32_MAX)
+        janet_panicf("option :%s is too large", name);
+    return (int) x;
+}
+static int option_boolean(Janet opts, const char *name, int dflt) {
+    Janet x = option(opts, name);
+    if (janet_checktype(x, JANET_NIL)) return dflt;
+    return janet_truthy(x);
+}
+
+static void cache_unlink(FileCache *fc, CacheEntry *e) {
+    if (e->prev) e->prev->next = e->next;
+    else fc->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else fc->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void cache_push_front(FileCache *fc, CacheEntry *e) {
+    e->prev = NULL;
+    e->next = fc->head;
+    if (fc->head) fc->head->prev = e;
+    fc->head = e;
+    if (!fc->tail) fc->tail = e;
+}
+
+#ifdef CIRCLET_INOTIFY
+static void cache_watch(FileCache *fc, CacheEntry *e, int wd) {
+    CacheWatch *w = (CacheWatch *) map_find(&fc->watches, (const char *) &wd, sizeof(wd));
+    if (!w) {
+        if (!(w = calloc(1, sizeof(CacheWatch)))) JANET_OUT_OF_MEMORY;
+        w->wd = wd;
+        w->node.key = (char *) &w->wd;
+        w->node.keylen = sizeof(w->wd);
+        map_insert(&fc->watches, &w->node);
+    }
+    e->watch = w;
+    e->watch_prev = NULL;
+    e->watch_next = w->entries;
+    if (w->entries) w->entries->watch_prev = e;
+    w->entries = e;
+}
+#endif
+
+/* Take an entry off its watch, removing the watch from the kernel with the
+ * last entry on it unless the kernel already dropped it */
+static void cache_unwatch(FileCache *fc, CacheEntry *e, int rm) {
+    CacheWatch *w = e->watch;
+    if (e->watch_prev) e->watch_prev->watch_next = e->watch_next;
+    else w->entries = e->watch_next;
+    if (e->watch_next) e->watch_next->watch_prev = e->watch_prev;
+    e->watch = NULL;
+    if (w->entries) return;
+    map_remove(&fc->watches, &w->node);
+#ifdef CIRCLET_INOTIFY
+    if (rm) inotify_rm_watch(fc->inotify_fd, w->wd);
+#else
+    (void) rm;
+#endif
+    free(w);
+}
+
+static void cache_evict(FileCache *fc, CacheEntry *e) {
+    if (e->watch) cache_unwatch(fc, e, 1);
+    map_remove(&fc->map, &e->node);
+    cache_unlink(fc, e);
+    fc->used -= e->cost;
+    free(e->data);
+    free(e->node.key);
+    free(e);
+}
+
+static void cache_init(FileCache *fc, size_t budget, size_t max_entry, double ttl, int watch) {
+    memset(fc, 0, sizeof(*fc));
+    fc->budget = budget;
+    fc->max_entry = max_entry;
+    fc->ttl = ttl;
+    fc->inotify_fd = -1;
+#ifdef CIRCLET_INOTIFY
+    if (budget && watch) fc->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#else
+    (void) watch;
+#endif
+}
+
+static void cache_deinit(FileCache *fc) {
+    while (fc->head) {
+        CacheEntry *e = fc->head;
+        fc->head = e->next;
+        if (e->watch) cache_unwatch(fc, e, 0);
+        free(e->data);
+        free(e->node.key);
+        free(e);
+    }
+    fc->tail = NULL;
+    fc->used = 0;
+    map_deinit(&fc->map);
+    map_deinit(&fc->watches);
+#ifdef CIRCLET_INOTIFY
+    if (fc->inotify_fd >= 0) {
+        close(fc->inotify_fd);
+        fc->inotify_fd = -1;
+    }
+#endif
+}
+
+/* Drop every entry whose file changed since it was cached. Reading the
+ * inotify queue happens at most once per poll iteration. */
+static void cache_drain_events(FileCache *fc, unsigned long generation) {
+#ifdef CIRCLET_INOTIFY
+    if (fc->inotify_fd < 0 || fc->drained == generation) return;
+    fc->drained = generation;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(fc->inotify_fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        for (char *p = buf; p < buf + n;) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            CacheWatch *w;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                while (fc->head) cache_evict(fc, fc->head);
+            } else {
+                while ((w = (CacheWatch *) map_find(&fc->watches, (const char *) &ev->wd,
+                                                    sizeof(ev->wd)))) {
+                    CacheEntry *e = w->entries;
+                    if (ev->mask & IN_IGNORED) cache_unwatch(fc, e, 0);
+                    cache_evict(fc, e);
+                }
+            }
+            p += sizeof(struct inotify_event) + ev->len;
         }
-        conn = conn->next;
     }
-    return 0;
+#else
+    (void) fc;
+    (void) generation;
+#endif
 }
 
-static struct JanetAbstractType Manager_jt = {
-    "mongoose.manager",
-    manager_gc,
-    manager_mark,
-#ifdef JANET_ATEND_GCMARK
-    JANET_ATEND_GCMARK
+/* Add an entry taking ownership of data, evicting older entries to stay
+ * within budget. The key must not be present. On failure data is freed and
+ * NULL is returned. */
+static CacheEntry *cache_insert(FileCache *fc, const char *key, size_t keylen,
+        char *data, size_t len) {
+    size_t cost = sizeof(CacheEntry) + keylen + len;
+    CacheEntry *e = NULL;
+    char *keycopy = NULL;
+    if (cost > fc->budget ||
+            (e = calloc(1, sizeof(CacheEntry))) == NULL ||
+            (keycopy = malloc(keylen)) == NULL) {
+        free(e);
+        free(data);
+        return NULL;
+    }
+    while (fc->used + cost > fc->budget && fc->tail)
+        cache_evict(fc, fc->tail);
+    memcpy(keycopy, key, keylen);
+    e->node.key = keycopy;
+    e->node.keylen = keylen;
+    e->data = data;
+    e->len = len;
+    e->cost = cost;
+    e->validated = mg_time();
+    map_insert(&fc->map, &e->node);
+    cache_push_front(fc, e);
+    fc->used += cost;
+    return e;
+}
+
+/* Read a regular file into a new cache entry with a prebuilt 200 response,
+ * all but the status line, Server and Date. Returns NULL if the file cannot
+ * or should not be cached. */
+static CacheEntry *cache_fill(FileCache *fc, const char *key, size_t keylen,
+        const char *path, struct mg_str mime, struct mg_str encoding,
+        struct mg_str extra_headers) {
+    cs_stat_t st;
+    if (mg_stat(path, &st) != 0 || !S_ISREG(st.st_mode)) return NULL;
+    if ((size_t) st.st_size > fc->max_entry) return NULL;
+
+    char etag[64], last_modified[64], head[512];
+    time_t mtime = st.st_mtime;
+    mg_http_construct_etag(etag, sizeof(etag), &st);
+    strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&mtime));
+    int header_len = snprintf(head, sizeof(head),
+            "Last-Modified: %s\r\n"
+            "Accept-Ranges: bytes\r\n"
+            "Content-Type: %.*s\r\n"
+            "Content-Length: %" INT64_FMT "\r\n"
+            "ETag: %s\r\n"
+            "%s%.*s%s"
+            "%.*s%s"
+            "\r\n",
+            last_modified, (int) mime.len, mime.p, (int64_t) st.st_size, etag,
+            encoding.len ? "Content-Encoding: " : "", (int) encoding.len, encoding.p,
+            encoding.len ? "\r\n" : "",
+            (int) extra_headers.len, extra_headers.p, extra_headers.len ? "\r\n" : "");
+    if (header_len < 0 || (size_t) header_len >= sizeof(head)) return NULL;
+
+    size_t len = (size_t) header_len + (size_t) st.st_size;
+    if (sizeof(CacheEntry) + keylen + len > fc->budget) return NULL;
+
+    char *data = malloc(len);
+    FILE *fp = NULL;
+    if (!data || (fp = mg_fopen(path, "rb")) == NULL) goto fail;
+    memcpy(data, head, header_len);
+    if (mg_fread(data + header_len, 1, st.st_size, fp) != (size_t) st.st_size) goto fail;
+    fclose(fp);
+
+    CacheEntry *e = cache_insert(fc, key, keylen, data, len);
+    if (!e) return NULL;
+    e->header_len = (size_t) header_len;
+    e->mtime = st.st_mtime;
+    memcpy(e->etag, etag, sizeof(etag));
+#ifdef CIRCLET_INOTIFY
+    if (fc->inotify_fd >= 0) {
+        int wd = inotify_add_watch(fc->inotify_fd, path,
+                                   IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                                   IN_MOVE_SELF | IN_DELETE_SELF);
+        if (wd >= 0) cache_watch(fc, e, wd);
+    }
 #endif
-};
+    return e;
 
-static Janet cfun_poll(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 2);
-    struct mg_mgr *mgr = janet_getabstract(argv, 0, &Manager_jt);
-    int32_t wait = janet_getinteger(argv, 1);
-    mg_mgr_poll(mgr, wait);
-    return argv[0];
+fail:
+    if (fp) fclose(fp);
+    free(data);
+    return NULL;
 }
 
-static Janet mg2janetstr(struct mg_str str) {
-    return janet_stringv((const uint8_t *) str.p, str.len);
+static void cache_touch(FileCache *fc, CacheEntry *e) {
+    if (fc->head != e) {
+        cache_unlink(fc, e);
+        cache_push_front(fc, e);
+    }
 }
 
-/* Turn a string value into c string */
-static const char *getstring(Janet x, const char *dflt) {
-    if (janet_checktype(x, JANET_STRING)) {
-        const uint8_t *bytes = janet_unwrap_string(x);
-        return (const char *)bytes;
+static CacheEntry *cache_lookup(FileCache *fc, const char *key, size_t keylen, const char *path) {
+    CacheEntry *e = (CacheEntry *) map_find(&fc->map, key, keylen);
+    if (!e) return NULL;
+    if (!e->watch) {
+        double now = mg_time();
+        if (now - e->validated >= fc->ttl) {
+            cs_stat_t st;
+            char etag[64];
+            if (mg_stat(path, &st) == 0) mg_http_construct_etag(etag, sizeof(etag), &st);
+            else etag[0] = '\0';
+            if (strcmp(etag, e->etag)) {
+                cache_evict(fc, e);
+                return NULL;
+            }
+            e->validated = now;
+        }
+    }
+    cache_touch(fc, e);
+    return e;
+}
+
+#ifndef MG_HIDE_SERVER_INFO
+#define SERVER_HEADER "Server: Mongoose/" MG_VERSION "\r\n"
+#else
+#define SERVER_HEADER ""
+#endif
+
+#define STATUS_LINE(code, reason) \
+    { code, "HTTP/1.1 " #code " " reason "\r\n", sizeof("HTTP/1.1 " #code " " reason "\r\n") - 1 }
+
+/* Preformatted status lines for the usual codes */
+static const struct {
+    int code;
+    const char *line;
+    size_t len;
+} status_lines[] = {
+    STATUS_LINE(200, "OK"),
+    STATUS_LINE(304, "Not Modified"),
+    STATUS_LINE(404, "Not Found"),
+    STATUS_LINE(201, "Created"),
+    STATUS_LINE(204, "No Content"),
+    STATUS_LINE(206, "Partial Content"),
+    STATUS_LINE(301, "Moved Permanently"),
+    STATUS_LINE(302, "Found"),
+    STATUS_LINE(303, "See Other"),
+    STATUS_LINE(307, "Temporary Redirect"),
+    STATUS_LINE(308, "Permanent Redirect"),
+    STATUS_LINE(400, "Bad Request"),
+    STATUS_LINE(401, "Unauthorized"),
+    STATUS_LINE(403, "Forbidden"),
+    STATUS_LINE(405, "Method Not Allowed"),
+    STATUS_LINE(409, "Conflict"),
+    STATUS_LINE(413, "Payload Too Large"),
+    STATUS_LINE(416, "Range Not Satisfiable"),
+    STATUS_LINE(429, "Too Many Requests"),
+    STATUS_LINE(500, "Internal Server Error"),
+    STATUS_LINE(502, "Bad Gateway"),
+    STATUS_LINE(503, "Service Unavailable"),
+    STATUS_LINE(504, "Gateway Timeout"),
+};
+
+/* Send the status line followed by the Server and Date headers. The two
+ * headers are kept formatted on the manager, and the date is renewed when
+ * the second mongoose last read a socket at has moved on. */
+static void send_status(struct mg_connection *c, int code) {
+    Manager *m = (Manager *) c->mgr;
+    size_t i;
+    for (i = 0; i < sizeof(status_lines) / sizeof(status_lines[0]); i++) {
+        if (status_lines[i].code == code) break;
+    }
+    if (i < sizeof(status_lines) / sizeof(status_lines[0])) {
+        mg_send(c, status_lines[i].line, (int) status_lines[i].len);
     } else {
-        return dflt;
+        mg_printf(c, "HTTP/1.1 %d %s\r\n", code, mg_status_message(code));
+    }
+    time_t now = c->last_io_time;
+    if (!now) now = time(NULL);
+    if (now > m->date_time) {
+        char date[40];
+        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&now));
+        m->date_len = snprintf(m->date, sizeof(m->date), SERVER_HEADER "Date: %s\r\n", date);
+        m->date_time = now;
     }
+    mg_send(c, m->date, (int) m->date_len);
 }
 
-static Janet build_http_request(struct mg_connection *c, struct http_message *hm) {
-    JanetTable *payload = janet_table(10);
-    janet_table_put(payload, janet_ckeywordv("body"), mg2janetstr(hm->body));
-    janet_table_put(payload, janet_ckeywordv("uri"), mg2janetstr(hm->uri));
-    janet_table_put(payload, janet_ckeywordv("query-string"), mg2janetstr(hm->query_string));
-    janet_table_put(payload, janet_ckeywordv("method"), mg2janetstr(hm->method));
-    janet_table_put(payload, janet_ckeywordv("protocol"), mg2janetstr(hm->proto));
-    janet_table_put(payload, janet_ckeywordv("connection"), janet_wrap_abstract(c->user_data));
-    /* Add headers */
-    JanetTable *headers = janet_table(5);
-    for (int i = 0; i < MG_MAX_HTTP_HEADERS; i++) {
-        if (hm->header_names[i].len == 0)
-            break;
-        Janet key = mg2janetstr(hm->header_names[i]);
-        Janet value = mg2janetstr(hm->header_values[i]);
-        Janet header = janet_table_get(headers, key);
-        switch (janet_type(header)) {
-            case JANET_NIL:
-                janet_table_put(headers, key, value);
-                break;
-            case JANET_ARRAY:
-                janet_array_push(janet_unwrap_array(header), value);
-                break;
-            default:
-                {
-                    Janet newHeader[2] = { header, value };
-                    janet_table_put(headers, key, janet_wrap_array(janet_array_n(newHeader, 2)));
-                    break;
+/* Connections held open by :sse responses, grouped by channel name so an
+ * event can be handed to all of them at once */
+typedef struct SseChannel {
+    MapNode node;
+    struct SseSubscriber *subscribers;
+} SseChannel;
+
+typedef struct SseSubscriber {
+    SseChannel *channel;
+    struct SseSubscriber *prev, *next;
+    struct mg_connection *conn;
+} SseSubscriber;
+
+static int sse_subscribe(struct mg_connection *c, const uint8_t *name, int32_t len) {
+    Manager *m = (Manager *) c->mgr;
+    SseSubscriber *sub = calloc(1, sizeof(SseSubscriber));
+    if (!sub) return 0;
+    SseChannel *ch = (SseChannel *) map_find(&m->sse_channels, (const char *) name, len);
+    if (!ch) {
+        ch = calloc(1, sizeof(SseChannel));
+        if (!ch || !(ch->node.key = malloc(len ? len : 1))) {
+            free(ch);
+            free(sub);
+            return 0;
+        }
+        memcpy(ch->node.key, name, len);
+        ch->node.keylen = len;
+        map_insert(&m->sse_channels, &ch->node);
+    }
+    sub->channel = ch;
+    sub->conn = c;
+    sub->next = ch->subscribers;
+    if (sub->next) sub->next->prev = sub;
+    ch->subscribers = sub;
+    c->priv_2 = sub;
+    c->flags |= CIRCLET_F_SSE;
+    return 1;
+}
+
+static void sse_unsubscribe(struct mg_connection *c) {
+    if (!(c->flags & CIRCLET_F_SSE)) return;
+    SseSubscriber *sub = (SseSubscriber *) c->priv_2;
+    SseChannel *ch = sub->channel;
+    if (sub->prev) sub->prev->next = sub->next;
+    else ch->subscribers = sub->next;
+    if (sub->next) sub->next->prev = sub->prev;
+    if (!ch->subscribers) {
+        map_remove(&((Manager *) c->mgr)->sse_channels, &ch->node);
+        free(ch->node.key);
+        free(ch);
+    }
+    free(sub);
+    c->priv_2 = NULL;
+    c->flags &= ~CIRCLET_F_SSE;
+}
+
+static int is_keepalive(struct http_message *hm) {
+    struct mg_str *conn_hdr = mg_get_http_header(hm, "Connection");
+    if (conn_hdr != NULL) return mg_vcasecmp(conn_hdr, "keep-alive") == 0;
+    return mg_vcmp(&hm->proto, "HTTP/1.1") == 0;
+}
+
+/* Whether the client takes gzip content-coding, honouring q=0 */
+static int accepts_gzip(struct http_message *hm) {
+    struct mg_str *hdr = mg_get_http_header(hm, "Accept-Encoding");
+    int star = 0;
+    if (!hdr) return 0;
+    const char *p = hdr->p, *end = hdr->p + hdr->len;
+    while (p < end) {
+        const char *tok, *tokend, *item_end = p;
+        while (item_end < end && *item_end != ',') item_end++;
+        while (p < item_end && (*p == ' ' || *p == '\t')) p++;
+        tok = p;
+        while (p < item_end && *p != ';' && *p != ' ' && *p != '\t') p++;
+        tokend = p;
+        int zero = 0;
+        const char *q = p;
+        while (q + 1 < item_end) {
+            if ((q[0] == 'q' || q[0] == 'Q') && q[1] == '=') {
+                q += 2;
+                zero = 1;
+                while (q < item_end && *q != ';') {
+                    if (*q >= '1' && *q <= '9') zero = 0;
+                    q++;
                 }
+                break;
+            }
+            q++;
+        }
+        size_t toklen = tokend - tok;
+        if ((toklen == 4 && !mg_ncasecmp(tok, "gzip", 4)) ||
+                (toklen == 6 && !mg_ncasecmp(tok, "x-gzip", 6)))
+            return !zero;
+        if (toklen == 1 && *tok == '*') star = !zero;
+        p = item_end + 1;
+    }
+    return star;
+}
+
+/* Skip the W/ prefix of a weak entity tag */
+static const char *etag_opaque(const char *tag, size_t *len) {
+    if (*len >= 2 && tag[0] == 'W' && tag[1] == '/') {
+        *len -= 2;
+        return tag + 2;
+    }
+    return tag;
+}
+
+/* Whether an If-None-Match header lists the entity tag, using weak
+ * comparison. With gzip_too, the tag with a -gzip suffix matches as well,
+ * for responses that may have been compressed. */
+static int etag_listed(const struct mg_str *hdr, const char *etag, size_t etaglen, int gzip_too) {
+    const char *p = hdr->p, *end = hdr->p + hdr->len;
+    etag = etag_opaque(etag, &etaglen);
+    if (etaglen < 2 || etag[etaglen - 1] != '"') return 0;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        if (p < end && *p == '*') return 1;
+        const char *tok = p;
+        if (end - p >= 2 && p[0] == 'W' && p[1] == '/') p += 2;
+        if (p < end && *p == '"') {
+            p++;
+            while (p < end && *p != '"') p++;
+            if (p < end) p++;
+        } else {
+            while (p < end && *p != ',') p++;
+        }
+        size_t len = p - tok;
+        const char *opaque = etag_opaque(tok, &len);
+        if (len == etaglen && !memcmp(opaque, etag, len)) return 1;
+        if (gzip_too && len == etaglen + 5 &&
+                !memcmp(opaque, etag, etaglen - 1) &&
+                !memcmp(opaque + etaglen - 1, "-gzip\"", 6))
+            return 1;
+    }
+    return 0;
+}
+
+/* Whether a GET or HEAD can be answered with 304, given the entity tag of
+ * the representation and its modification time (0 if unknown). As in
+ * RFC 7232, If-Modified-Since is ignored when If-None-Match is present. */
+static int not_modified(struct http_message *hm, const char *etag, size_t etaglen,
+        int gzip_too, time_t mtime) {
+    struct mg_str *hdr;
+    if (mg_vcmp(&hm->method, "GET") && mg_vcmp(&hm->method, "HEAD")) return 0;
+    if ((hdr = mg_get_http_header(hm, "If-None-Match")) != NULL)
+        return etag && etag_listed(hdr, etag, etaglen, gzip_too);
+    if (mtime && (hdr = mg_get_http_header(hm, "If-Modified-Since")) != NULL) {
+        char date[64];
+        if (hdr->len >= sizeof(date)) return 0;
+        memcpy(date, hdr->p, hdr->len);
+        date[hdr->len] = '\0';
+        time_t since = mg_parse_date_string(date);
+        return since && mtime <= since;
+    }
+    return 0;
+}
+
+static void send_not_modified(struct mg_connection *c, struct http_message *hm,
+        const char *etag, size_t etaglen, struct mg_str extra_headers) {
+    send_status(c, 304);
+    if (etag) mg_printf(c, "ETag: %.*s\r\n", (int) etaglen, etag);
+    if (extra_headers.len)
+        mg_printf(c, "%.*s\r\n", (int) extra_headers.len, extra_headers.p);
+    mg_printf(c, "\r\n");
+    if (!is_keepalive(hm)) c->flags |= MG_F_SEND_AND_CLOSE;
+}
+
+/* Entity tags of recent 200 responses, by request URI and query, so that a
+ * matching If-None-Match can be answered before the handler runs. Entries
+ * are trusted for etag-cache-ttl seconds, and the least recently used go
+ * first once there are too many. Clients that take gzip are kept apart,
+ * since they may have been sent a different representation. */
+typedef struct Validator {
+    MapNode node;
+    struct Validator *prev, *next;
+    double stored;
+    int vary;
+    size_t etaglen;
+    char etag[64];
+} Validator;
+
+/* Most entity tags remembered by a manager */
+#define CIRCLET_MAX_VALIDATORS 4096
+
+static void validator_unlink(Manager *m, Validator *v) {
+    if (v->prev) v->prev->next = v->next;
+    else m->validator_head = v->next;
+    if (v->next) v->next->prev = v->prev;
+    else m->validator_tail = v->prev;
+}
+
+static void validator_push_front(Manager *m, Validator *v) {
+    v->prev = NULL;
+    v->next = m->validator_head;
+    if (m->validator_head) m->validator_head->prev = v;
+    m->validator_head = v;
+    if (!m->validator_tail) m->validator_tail = v;
+}
+
+static void validator_evict(Manager *m, Validator *v) {
+    map_remove(&m->validators, &v->node);
+    validator_unlink(m, v);
+    free(v->node.key);
+    free(v);
+}
+
+static void validator_clear(Manager *m) {
+    Validator *v = m->validator_head;
+    while (v) {
+        Validator *next = v->next;
+        free(v->node.key);
+        free(v);
+        v = next;
+    }
+    m->validator_head = m->validator_tail = NULL;
+    map_deinit(&m->validators);
+}
+
+/* A tag sent to a client with credentials says nothing about what a client
+ * without them may see, and a request with them has to reach the handler
+ * that checks them, so neither side of the shortcut takes such requests. */
+static int validator_credentials(struct http_message *hm) {
+    return mg_get_http_header(hm, "Authorization") || mg_get_http_header(hm, "Cookie");
+}
+
+static size_t validator_key(struct http_message *hm, char *key, size_t cap) {
+    size_t len = 1 + hm->uri.len + 1 + hm->query_string.len;
+    if (len > cap) return 0;
+    key[0] = accepts_gzip(hm) ? 'z' : 'p';
+    memcpy(key + 1, hm->uri.p, hm->uri.len);
+    key[1 + hm->uri.len] = '?';
+    memcpy(key + 2 + hm->uri.len, hm->query_string.p, hm->query_string.len);
+    return len;
+}
+
+/* Remember the entity tag sent in a 200 response to a GET */
+static void validator_store(Manager *m, struct http_message *hm,
+        const char *etag, size_t etaglen, int vary) {
+    char key[CIRCLET_MAX_KEY];
+    size_t keylen;
+    if (m->validator_ttl <= 0 || etaglen >= sizeof(((Validator *) 0)->etag) ||
+            mg_vcmp(&hm->method, "GET") || validator_credentials(hm) ||
+            (keylen = validator_key(hm, key, sizeof(key))) == 0)
+        return;
+    Validator *v = (Validator *) map_find(&m->validators, key, keylen);
+    if (v) {
+        validator_unlink(m, v);
+    } else {
+        if (m->validators.count >= CIRCLET_MAX_VALIDATORS) validator_evict(m, m->validator_tail);
+        v = calloc(1, sizeof(Validator));
+        if (!v || !(v->node.key = malloc(keylen))) {
+            free(v);
+            return;
+        }
+        memcpy(v->node.key, key, keylen);
+        v->node.keylen = keylen;
+        map_insert(&m->validators, &v->node);
+    }
+    validator_push_front(m, v);
+    v->stored = mg_time();
+    v->vary = vary;
+    v->etaglen = etaglen;
+    memcpy(v->etag, etag, etaglen);
+}
+
+/* Answer a conditional request with 304 from a remembered entity tag.
+ * Returns 0 if the request has to go to the handler. */
+static int validator_check(struct mg_connection *c, struct http_message *hm) {
+    Manager *m = (Manager *) c->mgr;
+    char key[CIRCLET_MAX_KEY];
+    size_t keylen;
+    if (m->validator_ttl <= 0 || !m->validators.count ||
+            (mg_vcmp(&hm->method, "GET") && mg_vcmp(&hm->method, "HEAD")) ||
+            !mg_get_http_header(hm, "If-None-Match") || validator_credentials(hm) ||
+            (keylen = validator_key(hm, key, sizeof(key))) == 0)
+        return 0;
+    Validator *v = (Validator *) map_find(&m->validators, key, keylen);
+    if (!v) return 0;
+    if (mg_time() - v->stored >= m->validator_ttl) {
+        validator_evict(m, v);
+        return 0;
+    }
+    if (!not_modified(hm, v->etag, v->etaglen, 0, 0)) return 0;
+    validator_unlink(m, v);
+    validator_push_front(m, v);
+    send_not_modified(c, hm, v->etag, v->etaglen,
+                      mg_mk_str(v->vary ? "Vary: Accept-Encoding" : NULL));
+    return 1;
+}
+
+/* Try to answer a GET or HEAD for a file from the cache, filling the cache
+ * on a miss. Returns 0 if the request must be served some other way. */
+static int cache_serve(struct mg_connection *c, struct http_message *hm,
+        const char *key, size_t keylen, const char *path,
+        struct mg_str mime, struct mg_str encoding, struct mg_str extra_headers) {
+    Manager *m = (Manager *) c->mgr;
+    FileCache *fc = &m->file_cache;
+    if (!fc->budget) return 0;
+    int head = !mg_vcmp(&hm->method, "HEAD");
+    if (!head && mg_vcmp(&hm->method, "GET")) return 0;
+    if (mg_get_http_header(hm, "Range")) return 0;
+    cache_drain_events(fc, m->generation);
+    CacheEntry *e = cache_lookup(fc, key, keylen, path);
+    if (!e) e = cache_fill(fc, key, keylen, path, mime, encoding, extra_headers);
+    if (!e) return 0;
+    size_t etaglen = strlen(e->etag);
+    if (not_modified(hm, e->etag, etaglen, 0, e->mtime)) {
+        send_not_modified(c, hm, e->etag, etaglen, extra_headers);
+        return 1;
+    }
+    send_status(c, 200);
+    mg_send(c, e->data, head ? e->header_len : e->len);
+    if (!is_keepalive(hm)) c->flags |= MG_F_SEND_AND_CLOSE;
+    validator_store(m, hm, e->etag, etaglen, extra_headers.len > 0);
+    return 1;
+}
+
+/* Map a request URI onto a path under root without touching the
+ * filesystem. Writes the decoded, normalized URI path to uripath and the
+ * local path to localpath. Returns 0 for anything unusual, in which case
+ * the request should be left to mongoose. */
+static int static_resolve(struct http_message *hm, const char *root,
+        char *uripath, size_t *uripathlen, char *localpath, size_t localcap) {
+    char norm[CIRCLET_MAX_KEY];
+    if (hm->uri.len == 0 || hm->uri.len >= sizeof(norm)) return 0;
+    memcpy(norm, hm->uri.p, hm->uri.len);
+    struct mg_str in = mg_mk_str_n(norm, hm->uri.len), out = in;
+    if (!mg_normalize_uri_path(&in, &out)) return 0;
+
+    size_t rootlen = strlen(root);
+    while (rootlen > 1 && (root[rootlen - 1] == '/' || root[rootlen - 1] == DIRSEP)) rootlen--;
+    if (rootlen + out.len >= localcap) return 0;
+    memcpy(localpath, root, rootlen);
+    char *lp = localpath + rootlen;
+    size_t ulen = 0;
+
+    /* Decode one component at a time, so encoded separators and dot
+     * segments cannot escape the root. */
+    const char *s = out.p, *end = out.p + out.len;
+    while (s < end) {
+        const char *e = s + 1;
+        while (e < end && *e != '/') e++;
+        uripath[ulen++] = '/';
+        if (e > s + 1) {
+            char *comp = uripath + ulen;
+            int n = mg_url_decode(s + 1, (int) (e - s - 1), comp, CIRCLET_MAX_KEY - (int) ulen, 0);
+            if (n <= 0) return 0;
+            if ((n == 1 && comp[0] == '.') || (n == 2 && comp[0] == '.' && comp[1] == '.')) return 0;
+            for (int i = 0; i < n; i++) {
+                if (comp[i] == '\0' || comp[i] == '/' || comp[i] == DIRSEP) return 0;
+            }
+            if ((size_t) (lp - localpath) + n + 2 >= localcap) return 0;
+            *lp++ = DIRSEP;
+            memcpy(lp, comp, n);
+            lp += n;
+            ulen += n;
+        }
+        s = e;
+    }
+    *lp = '\0';
+    *uripathlen = ulen;
+    return 1;
+}
+
+/* Files that mongoose treats specially and that must not be cached */
+static const char *static_special_pattern = "**.shtml$|**.shtm$|**.cgi$|**.php$|**.htpasswd$";
+
+/* Find the first value of a response header, ignoring case. Values may be
+ * strings or arrays of strings, as in the response :headers table. */
+static int response_header(const JanetKV *kvs, int32_t cap, const char *name,
+        const uint8_t **value, int32_t *len) {
+    size_t namelen = strlen(name);
+    for (const JanetKV *kv = janet_dictionary_next(kvs, cap, NULL);
+            kv;
+            kv = janet_dictionary_next(kvs, cap, kv)) {
+        const uint8_t *key;
+        int32_t keylen;
+        if (!janet_bytes_view(kv->key, &key, &keylen) || (size_t) keylen != namelen ||
+                mg_ncasecmp((const char *) key, name, namelen))
+            continue;
+        const Janet *items;
+        int32_t nitems;
+        Janet v = kv->value;
+        if (janet_indexed_view(v, &items, &nitems)) {
+            if (!nitems) continue;
+            v = items[0];
         }
+        if (janet_bytes_view(v, value, len)) return 1;
+    }
+    return 0;
+}
+
+#if CIRCLET_ENABLE_ZLIB
+
+/* Whether a body of the given Content-Type is worth compressing. Bodies
+ * without a type are assumed to be text. */
+static int compressible_type(const uint8_t *type, int32_t len) {
+    static const char *const words[] = {"json", "javascript", "xml", "svg", "csv"};
+    if (!type) return 1;
+    if (len >= 5 && !mg_ncasecmp((const char *) type, "text/", 5)) return 1;
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        size_t n = strlen(words[i]);
+        for (int32_t j = 0; j + (int32_t) n <= len; j++)
+            if (!mg_ncasecmp((const char *) type + j, words[i], n)) return 1;
+    }
+    return 0;
+}
+
+/* Deflate a buffer into a new gzip stream. Returns NULL on failure or if
+ * the result would not be smaller than the input. */
+static char *gzip_compress(const uint8_t *data, size_t len, int level, size_t *outlen) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+    size_t cap = deflateBound(&zs, (uLong) len);
+    char *out = malloc(cap);
+    if (out) {
+        zs.next_in = (Bytef *) data;
+        zs.avail_in = (uInt) len;
+        zs.next_out = (Bytef *) out;
+        zs.avail_out = (uInt) cap;
+        if (deflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out >= len) {
+            free(out);
+            out = NULL;
+        } else {
+            *outlen = zs.total_out;
+        }
+    }
+    deflateEnd(&zs);
+    return out;
+}
+
+/* Compressed form of a generic response body, or NULL to send it as is.
+ * Bodies with an ETag are kept in the compress cache under the request
+ * URI, query string and tag, so repeated hits are not compressed again. The result
+ * is owned by the cache if *owned is left 0. */
+static const char *compress_body(Manager *m, struct http_message *hm,
+        const char *etag, int32_t etaglen,
+        const uint8_t *body, int32_t bodylen, size_t *outlen, int *owned) {
+    FileCache *fc = &m->compress_cache;
+    char *key = NULL;
+    size_t keylen = 0;
+    *owned = 0;
+    if (etag && fc->budget) {
+        keylen = hm->uri.len + 1 + hm->query_string.len + 1 + (size_t) etaglen;
+        key = malloc(keylen);
+        if (key) {
+            char *p = key;
+            memcpy(p, hm->uri.p, hm->uri.len);
+            p += hm->uri.len;
+            *p++ = '?';
+            memcpy(p, hm->query_string.p, hm->query_string.len);
+            p += hm->query_string.len;
+            *p++ = '\0';
+            memcpy(p, etag, etaglen);
+            CacheEntry *e = (CacheEntry *) map_find(&fc->map, key, keylen);
+            if (e) {
+                free(key);
+                cache_touch(fc, e);
+                *outlen = e->len;
+                return e->data;
+            }
+        }
+    }
+    char *out = gzip_compress(body, (size_t) bodylen, m->compress_level, outlen);
+    if (out && key) {
+        /* The cache takes ownership and frees the buffer if it cannot be
+         * stored, so keep a copy in that case. */
+        if (sizeof(CacheEntry) + keylen + *outlen <= fc->budget) {
+            CacheEntry *e = cache_insert(fc, key, keylen, out, *outlen);
+            out = e ? e->data : NULL;
+        } else {
+            *owned = 1;
+        }
+    } else if (out) {
+        *owned = 1;
+    }
+    free(key);
+    return out;
+}
+
+#endif
+
+/* What we know about a local path: whether it is a plain file that can be
+ * served directly, and whether a precompressed sibling exists. Results are
+ * kept for file-cache-ttl seconds. */
+typedef struct PathInfo {
+    MapNode node;
+    struct PathInfo *all;
+    double checked;
+    int simple;
+    int has_gz;
+} PathInfo;
+
+static void path_info_clear(Manager *m) {
+    PathInfo *pi = m->path_infos;
+    while (pi) {
+        PathInfo *next = pi->all;
+        free(pi->node.key);
+        free(pi);
+        pi = next;
+    }
+    m->path_infos = NULL;
+    map_deinit(&m->path_info);
+}
+
+static PathInfo *path_info_get(Manager *m, const char *path, int is_static) {
+    char key[CIRCLET_MAX_KEY * 2 + 8];
+    size_t pathlen = strlen(path);
+    if (pathlen + 5 >= sizeof(key)) return NULL;
+    key[0] = is_static ? 's' : 'f';
+    memcpy(key + 1, path, pathlen);
+    size_t keylen = pathlen + 1;
+    double now = mg_time();
+    PathInfo *pi = (PathInfo *) map_find(&m->path_info, key, keylen);
+    if (pi && now - pi->checked < m->file_cache.ttl) return pi;
+    if (!pi) {
+        if (m->path_info.count >= 4096) path_info_clear(m);
+        pi = calloc(1, sizeof(PathInfo));
+        if (!pi || !(pi->node.key = malloc(keylen))) {
+            free(pi);
+            return NULL;
+        }
+        memcpy(pi->node.key, key, keylen);
+        pi->node.keylen = keylen;
+        map_insert(&m->path_info, &pi->node);
+        pi->all = m->path_infos;
+        m->path_infos = pi;
+    }
+    pi->checked = now;
+    cs_stat_t st;
+    pi->simple = mg_stat(path, &st) == 0 && S_ISREG(st.st_mode);
+    if (pi->simple && is_static) {
+        /* Leave anything mongoose handles specially to mongoose, including
+         * directories protected by a password file. */
+        const char *slash = strrchr(path, DIRSEP);
+        if (!slash || mg_match_prefix(static_special_pattern,
+                                      (int) strlen(static_special_pattern), path) > 0) {
+            pi->simple = 0;
+        } else {
+            snprintf(key, sizeof(key), "%.*s%c.htpasswd", (int) (slash - path), path, DIRSEP);
+            if (mg_stat(key, &st) == 0) pi->simple = 0;
+        }
+    }
+    pi->has_gz = 0;
+    if (pi->simple && m->precompressed) {
+        snprintf(key, sizeof(key), "%s.gz", path);
+        pi->has_gz = mg_stat(key, &st) == 0 && S_ISREG(st.st_mode);
+    }
+    return pi;
+}
+
+/* Serve a resolved regular file, preferring its precompressed sibling when
+ * one exists and the client accepts gzip. The first two bytes of key are
+ * reserved for the variant. Validators are checked against st (or gzst for
+ * the compressed variant), or against a fresh stat when those are NULL. */
+static void serve_resolved(struct mg_connection *c, struct http_message *hm,
+        char *key, size_t keylen, const char *path, int has_gz,
+        struct mg_str mime, struct mg_str encoding,
+        cs_stat_t *st, cs_stat_t *gzst) {
+    char gzpath[CIRCLET_MAX_KEY * 2 + 8];
+    const char *variant = path;
+    struct mg_str extra = MG_NULL_STR;
+    key[1] = 'p';
+    if (has_gz) {
+        extra = mg_mk_str("Vary: Accept-Encoding");
+        key[1] = 'v';
+        if (!encoding.len && accepts_gzip(hm) &&
+                snprintf(gzpath, sizeof(gzpath), "%s.gz", path) < (int) sizeof(gzpath)) {
+            variant = gzpath;
+            encoding = mg_mk_str("gzip");
+            key[1] = 'z';
+            st = gzst;
+        }
+    }
+    if (cache_serve(c, hm, key, keylen, variant, mime, encoding, extra)) return;
+    /* With file threads, leave the stat and the 304 check to them */
+    cs_stat_t fresh;
+#if MG_ENABLE_FILE_THREADS
+    int threaded = c->mgr->file_pool != NULL;
+#else
+    int threaded = 0;
+#endif
+    if (!st && !threaded && mg_stat(variant, &fresh) == 0) st = &fresh;
+    if (st) {
+        char etag[64];
+        mg_http_construct_etag(etag, sizeof(etag), st);
+        size_t etaglen = strlen(etag);
+        if (not_modified(hm, etag, etaglen, 0, st->st_mtime)) {
+            send_not_modified(c, hm, etag, etaglen, extra);
+            return;
+        }
+        if (!mg_get_http_header(hm, "Range"))
+            validator_store((Manager *) c->mgr, hm, etag, etaglen, has_gz);
+    }
+    mg_http_serve_file_internal(c, hm, variant, mime, encoding, extra);
+}
+
+/* Serve a :static request for a plain file without going through
+ * mg_serve_http. Returns 0 if mongoose has to handle the request. */
+static int serve_static_file(struct mg_connection *c, struct http_message *hm, const char *root) {
+    Manager *m = (Manager *) c->mgr;
+    if (!m->file_cache.budget && !m->precompressed) return 0;
+    if (mg_vcmp(&hm->method, "GET") && mg_vcmp(&hm->method, "HEAD")) return 0;
+    char key[CIRCLET_MAX_KEY * 2], localpath[CIRCLET_MAX_KEY * 2];
+    size_t rootlen = strlen(root), ulen;
+    if (rootlen + 3 >= CIRCLET_MAX_KEY) return 0;
+    key[0] = 's';
+    memcpy(key + 2, root, rootlen);
+    key[rootlen + 2] = '\0';
+    if (!static_resolve(hm, root, key + rootlen + 3, &ulen, localpath, sizeof(localpath))) return 0;
+    if (key[rootlen + 2 + ulen] == '/') return 0; /* Directory, may need an index file */
+    PathInfo *pi = path_info_get(m, localpath, 1);
+    if (!pi || !pi->simple) return 0;
+    struct mg_serve_http_opts opts;
+    struct mg_str mime = MG_NULL_STR, encoding = MG_NULL_STR;
+    memset(&opts, 0, sizeof(opts));
+    if (!mg_get_mime_type_encoding(mg_mk_str(localpath), &mime, &encoding, &opts))
+        mime = mg_mk_str("text/plain");
+    serve_resolved(c, hm, key, rootlen + 3 + ulen, localpath, pi->has_gz,
+                   mime, encoding, NULL, NULL);
+    return 1;
+}
+
+/* Serve a :file response */
+static void serve_file(struct mg_connection *c, struct http_message *hm,
+        const char *path, const char *mime) {
+    Manager *m = (Manager *) c->mgr;
+    char key[CIRCLET_MAX_KEY];
+    int keylen = snprintf(key, sizeof(key), "f.%s%c%s", mime, '\0', path);
+    PathInfo *pi = m->precompressed ? path_info_get(m, path, 0) : NULL;
+    if (keylen > 0 && keylen < (int) sizeof(key) && (!pi || pi->simple)) {
+        serve_resolved(c, hm, key, keylen, path, pi && pi->has_gz,
+                       mg_mk_str(mime), mg_mk_str(NULL), NULL, NULL);
+        return;
+    }
+    mg_http_serve_file(c, hm, path, mg_mk_str(mime), mg_mk_str(""));
+}
+
+#ifndef _WIN32
+
+static const char *static_index_files[] = {
+    "index.html", "index.htm", "index.shtml", "index.cgi", "index.php", NULL
+};
+
+static void index_add(StaticIndex *ix, const char *uri, size_t urilen,
+        const char *path, const cs_stat_t *st, int kind) {
+    if (map_find(&ix->map, uri, urilen)) return;
+    IndexEntry *e = calloc(1, sizeof(IndexEntry));
+    if (!e) JANET_OUT_OF_MEMORY;
+    e->node.key = malloc(urilen);
+    e->path = path ? strdup(path) : NULL;
+    if (!e->node.key || (path && !e->path)) JANET_OUT_OF_MEMORY;
+    memcpy(e->node.key, uri, urilen);
+    e->node.keylen = urilen;
+    e->kind = kind;
+    if (st) {
+        e->ino = st->st_ino;
+        e->size = st->st_size;
+        e->mtime = st->st_mtime;
+    }
+    if (kind == INDEX_FILE && ix->precompressed) {
+        char gzpath[CIRCLET_MAX_KEY * 2 + 8];
+        cs_stat_t gzst;
+        snprintf(gzpath, sizeof(gzpath), "%s.gz", path);
+        if (mg_stat(gzpath, &gzst) == 0 && S_ISREG(gzst.st_mode)) {
+            e->has_gz = 1;
+            e->gz_ino = gzst.st_ino;
+            e->gz_size = gzst.st_size;
+            e->gz_mtime = gzst.st_mtime;
+        }
+    }
+    e->all = ix->entries;
+    if (ix->entries) ix->entries->all_prev = e;
+    ix->entries = e;
+    map_insert(&ix->map, &e->node);
+}
+
+/* Index a regular file of a directory, leaving it to mongoose if the
+ * directory has a password file or the file is a script */
+static void index_add_file(StaticIndex *ix, const char *uri, size_t urilen,
+        const char *local, const cs_stat_t *st, int protected) {
+    int special = mg_match_prefix(static_special_pattern,
+                                  (int) strlen(static_special_pattern), local) > 0;
+    index_add(ix, uri, urilen, local, st,
+              (protected || special) ? INDEX_PASSTHROUGH : INDEX_FILE);
+}
+
+/* Index the URI of a directory itself, which resolves to its index file,
+ * if any. local is a scratch buffer holding the directory's local path. */
+static void index_add_dir_entry(StaticIndex *ix, char *local, size_t locallen,
+        const char *uri, size_t urilen, int protected) {
+    cs_stat_t st;
+    int found = 0;
+    for (const char **name = static_index_files; *name; name++) {
+        snprintf(local + locallen, CIRCLET_MAX_KEY * 2 - locallen, "%c%s", DIRSEP, *name);
+        if (mg_stat(local, &st) == 0 && S_ISREG(st.st_mode)) {
+            index_add_file(ix, uri, urilen, local, &st, protected);
+            found = 1;
+            break;
+        }
+    }
+    local[locallen] = '\0';
+    if (!found) index_add(ix, uri, urilen, NULL, NULL, INDEX_PASSTHROUGH);
+}
+
+static void index_dir_free(IndexDir *d) {
+    free(d->local);
+    free(d->uri);
+    free(d);
+}
+
+#ifdef CIRCLET_INOTIFY
+static IndexDir *index_watch_dir(StaticIndex *ix, const char *local, size_t locallen,
+        const char *uri, size_t urilen, int depth) {
+    int wd = inotify_add_watch(ix->inotify_fd, local,
+                               IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                               IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd < 0) return NULL;
+    IndexDir *d = calloc(1, sizeof(IndexDir));
+    if (!d || !(d->local = malloc(locallen + 1)) || !(d->uri = malloc(urilen)))
+        JANET_OUT_OF_MEMORY;
+    memcpy(d->local, local, locallen);
+    d->local[locallen] = '\0';
+    memcpy(d->uri, uri, urilen);
+    d->locallen = locallen;
+    d->urilen = urilen;
+    d->wd = wd;
+    d->depth = depth;
+    /* Not to be handed the event that got it scanned again */
+    d->seen = ix->events;
+    d->next = ix->dirs;
+    ix->dirs = d;
+    return d;
+}
+#endif
+
+/* Recursively index a directory. local and uri are scratch buffers holding
+ * the directory's local path and URI path (ending in a slash). */
+static void index_scan_dir(StaticIndex *ix, char *local, size_t locallen,
+        char *uri, size_t urilen, int depth) {
+    cs_stat_t st;
+    DIR *dir;
+    struct dirent *dp;
+    int protected;
+    IndexDir *watched = NULL;
+
+    if (depth > 32 || (dir = opendir(local)) == NULL) return;
+#ifdef CIRCLET_INOTIFY
+    if (ix->inotify_fd >= 0) watched = index_watch_dir(ix, local, locallen, uri, urilen, depth);
+#endif
+
+    /* Directories with a password file are left entirely to mongoose */
+    snprintf(local + locallen, CIRCLET_MAX_KEY * 2 - locallen, "%c.htpasswd", DIRSEP);
+    protected = mg_stat(local, &st) == 0;
+    local[locallen] = '\0';
+    if (watched) watched->protected = protected;
+
+    index_add_dir_entry(ix, local, locallen, uri, urilen, protected);
+
+    while ((dp = readdir(dir)) != NULL) {
+        size_t namelen = strlen(dp->d_name);
+        if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..") ||
+                !strcmp(dp->d_name, ".htpasswd"))
+            continue;
+        if (locallen + namelen + 2 >= CIRCLET_MAX_KEY * 2 ||
+                urilen + namelen + 2 >= CIRCLET_MAX_KEY)
+            continue;
+        local[locallen] = DIRSEP;
+        memcpy(local + locallen + 1, dp->d_name, namelen + 1);
+        memcpy(uri + urilen, dp->d_name, namelen);
+        if (mg_stat(local, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            uri[urilen + namelen] = '/';
+            index_scan_dir(ix, local, locallen + namelen + 1, uri, urilen + namelen + 1, depth + 1);
+        } else if (S_ISREG(st.st_mode)) {
+            index_add_file(ix, uri, urilen + namelen, local, &st, protected);
+        }
+    }
+    local[locallen] = '\0';
+    closedir(dir);
+}
+
+static void index_clear(StaticIndex *ix) {
+    IndexEntry *e = ix->entries;
+    while (e) {
+        IndexEntry *next = e->all;
+        free(e->node.key);
+        free(e->path);
+        free(e);
+        e = next;
+    }
+    ix->entries = NULL;
+    map_deinit(&ix->map);
+    while (ix->dirs) {
+        IndexDir *next = ix->dirs->next;
+        index_dir_free(ix->dirs);
+        ix->dirs = next;
+    }
+}
+
+static void index_build(StaticIndex *ix) {
+    char local[CIRCLET_MAX_KEY * 2], uri[CIRCLET_MAX_KEY];
+    size_t rootlen = strlen(ix->root);
+    index_clear(ix);
+#ifdef CIRCLET_INOTIFY
+    /* Start over with a fresh watch list */
+    if (ix->inotify_fd >= 0) {
+        close(ix->inotify_fd);
+        ix->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+#endif
+    memcpy(local, ix->root, rootlen + 1);
+    uri[0] = '/';
+    ix->dirty = 0;
+    index_scan_dir(ix, local, rootlen, uri, 1, 0);
+}
+
+static void index_free(StaticIndex *ix) {
+    index_clear(ix);
+#ifdef CIRCLET_INOTIFY
+    if (ix->inotify_fd >= 0) close(ix->inotify_fd);
+#endif
+    free(ix->root);
+    free(ix);
+}
+
+static void index_add_root(Manager *m, const char *root, int watch) {
+    size_t rootlen = strlen(root);
+    while (rootlen > 1 && (root[rootlen - 1] == '/' || root[rootlen - 1] == DIRSEP)) rootlen--;
+    if (rootlen + 2 >= CIRCLET_MAX_KEY) janet_panicf("static root %s is too long", root);
+    StaticIndex *ix = calloc(1, sizeof(StaticIndex));
+    if (!ix || !(ix->root = malloc(rootlen + 1))) JANET_OUT_OF_MEMORY;
+    memcpy(ix->root, root, rootlen);
+    ix->root[rootlen] = '\0';
+    ix->inotify_fd = -1;
+    ix->precompressed = m->precompressed;
+#ifdef CIRCLET_INOTIFY
+    if (watch) ix->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#else
+    (void) watch;
+#endif
+    index_build(ix);
+    ix->next = m->indexes;
+    m->indexes = ix;
+}
+
+#ifdef CIRCLET_INOTIFY
+static void index_remove(StaticIndex *ix, IndexEntry *e) {
+    map_remove(&ix->map, &e->node);
+    if (e->all_prev) e->all_prev->all = e->all;
+    else ix->entries = e->all;
+    if (e->all) e->all->all_prev = e->all_prev;
+    free(e->node.key);
+    free(e->path);
+    free(e);
+}
+
+/* Forget every entry and watched directory under a URI prefix ending in a
+ * slash. The prefix must not point into any of them. */
+static void index_drop_tree(StaticIndex *ix, const char *uri, size_t urilen) {
+    IndexEntry *e = ix->entries;
+    while (e) {
+        IndexEntry *next = e->all;
+        if (e->node.keylen >= urilen && !memcmp(e->node.key, uri, urilen)) index_remove(ix, e);
+        e = next;
+    }
+    IndexDir **at = &ix->dirs;
+    while (*at) {
+        IndexDir *d = *at;
+        if (d->urilen < urilen || memcmp(d->uri, uri, urilen)) {
+            at = &d->next;
+            continue;
+        }
+        *at = d->next;
+        /* The kernel hands out one watch per inode, so only drop it once
+         * no other directory shares it. */
+        int shared = 0;
+        for (IndexDir *o = ix->dirs; o; o = o->next) {
+            if (o->wd == d->wd) {
+                shared = 1;
+                break;
+            }
+        }
+        if (!shared) inotify_rm_watch(ix->inotify_fd, d->wd);
+        index_dir_free(d);
+    }
+}
+
+/* Index a directory and everything below it over again */
+static void index_rescan_dir(StaticIndex *ix, IndexDir *d) {
+    char local[CIRCLET_MAX_KEY * 2], uri[CIRCLET_MAX_KEY];
+    size_t locallen = d->locallen, urilen = d->urilen;
+    int depth = d->depth;
+    memcpy(local, d->local, locallen + 1);
+    memcpy(uri, d->uri, urilen);
+    index_drop_tree(ix, uri, urilen);
+    index_scan_dir(ix, local, locallen, uri, urilen, depth);
+}
+
+/* Index a name in a watched directory over again, after it was created,
+ * changed or removed */
+static void index_refresh(StaticIndex *ix, IndexDir *d, const char *name, size_t namelen) {
+    char local[CIRCLET_MAX_KEY * 2], uri[CIRCLET_MAX_KEY];
+    size_t locallen = d->locallen + 1 + namelen, urilen = d->urilen + namelen;
+    cs_stat_t st;
+    if (locallen + 1 >= sizeof(local) || urilen + 2 >= sizeof(uri)) return;
+    memcpy(local, d->local, d->locallen);
+    local[d->locallen] = DIRSEP;
+    memcpy(local + d->locallen + 1, name, namelen);
+    local[locallen] = '\0';
+    memcpy(uri, d->uri, d->urilen);
+    memcpy(uri + d->urilen, name, namelen);
+
+    IndexEntry *e = (IndexEntry *) map_find(&ix->map, uri, urilen);
+    if (e) index_remove(ix, e);
+    uri[urilen] = '/';
+    if (map_find(&ix->map, uri, urilen + 1)) index_drop_tree(ix, uri, urilen + 1);
+    if (mg_stat(local, &st) == 0) {
+        if (S_ISDIR(st.st_mode))
+            index_scan_dir(ix, local, locallen, uri, urilen + 1, d->depth + 1);
+        else if (S_ISREG(st.st_mode))
+            index_add_file(ix, uri, urilen, local, &st, d->protected);
+    }
+
+    /* The directory itself may resolve to a different index file now */
+    for (const char **index = static_index_files; *index; index++) {
+        if (strlen(*index) != namelen || memcmp(*index, name, namelen)) continue;
+        if ((e = (IndexEntry *) map_find(&ix->map, d->uri, d->urilen))) index_remove(ix, e);
+        memcpy(local, d->local, d->locallen + 1);
+        index_add_dir_entry(ix, local, d->locallen, d->uri, d->urilen, d->protected);
+        break;
+    }
+
+    /* A precompressed sibling is part of the entry of its file */
+    if (ix->precompressed && namelen > 3 && !memcmp(name + namelen - 3, ".gz", 3) &&
+            map_find(&ix->map, uri, urilen - 3))
+        index_refresh(ix, d, name, namelen - 3);
+}
+
+static void index_apply_event(StaticIndex *ix, const struct inotify_event *ev) {
+    unsigned long seq = ++ix->events;
+    IndexDir *d = ix->dirs;
+    /* The event belongs to every path of its directory. Handling it may add
+     * or drop directories, so the search starts over after each one. */
+    while (d) {
+        if (d->wd != ev->wd || d->seen == seq) {
+            d = d->next;
+            continue;
+        }
+        d->seen = seq;
+        if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+            /* Anything but the root goes with the event of its parent */
+            if (!d->depth) ix->dirty = 1;
+        } else if (ev->len && !strcmp(ev->name, ".htpasswd")) {
+            index_rescan_dir(ix, d);
+        } else if (ev->len) {
+            index_refresh(ix, d, ev->name, strlen(ev->name));
+        }
+        d = ix->dirs;
+    }
+}
+#endif
+
+/* Bring the index up to date with the changes below a watched root, one
+ * name at a time. Only lost events, or the root itself going away, mark
+ * the whole index for a rescan. Reading the inotify queue happens at most
+ * once per poll iteration. */
+static void index_drain_events(StaticIndex *ix, unsigned long generation) {
+#ifdef CIRCLET_INOTIFY
+    if (ix->inotify_fd < 0 || ix->drained == generation) return;
+    ix->drained = generation;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(ix->inotify_fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        for (char *p = buf; p < buf + n;) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            if (ev->mask & IN_Q_OVERFLOW) ix->dirty = 1;
+            else if (!ix->dirty) index_apply_event(ix, ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+#else
+    (void) ix;
+    (void) generation;
+#endif
+}
+
+/* Serve a :static request using the index of its root. Returns 0 if the
+ * root is not indexed, or the request should be left to mongoose. */
+static int index_serve_static(struct mg_connection *c, struct http_message *hm, const char *root) {
+    Manager *m = (Manager *) c->mgr;
+    StaticIndex *ix;
+    size_t rootlen = strlen(root);
+    while (rootlen > 1 && (root[rootlen - 1] == '/' || root[rootlen - 1] == DIRSEP)) rootlen--;
+    for (ix = m->indexes; ix; ix = ix->next) {
+        if (!strncmp(ix->root, root, rootlen) && ix->root[rootlen] == '\0') break;
+    }
+    if (!ix) return 0;
+    if (mg_vcmp(&hm->method, "GET") && mg_vcmp(&hm->method, "HEAD")) return 0;
+
+    index_drain_events(ix, m->generation);
+    if (ix->dirty) index_build(ix);
+
+    char key[CIRCLET_MAX_KEY * 2], localpath[CIRCLET_MAX_KEY * 2];
+    size_t ulen;
+    key[0] = 's';
+    memcpy(key + 2, ix->root, rootlen);
+    key[rootlen + 2] = '\0';
+    char *uri = key + rootlen + 3;
+    if (!static_resolve(hm, ix->root, uri, &ulen, localpath, sizeof(localpath))) return 0;
+
+    IndexEntry *e = (IndexEntry *) map_find(&ix->map, uri, ulen);
+    if (!e) {
+        /* A directory requested without its trailing slash is redirected,
+         * anything else is known not to exist. */
+        uri[ulen] = '/';
+        if (uri[ulen - 1] != '/' && map_find(&ix->map, uri, ulen + 1)) {
+            send_status(c, 301);
+            mg_printf(c, "Location: %.*s/%s%.*s\r\nContent-Length: 0\r\n\r\n",
+                      (int) hm->uri.len, hm->uri.p, hm->query_string.len ? "?" : "",
+                      (int) hm->query_string.len,
+                      hm->query_string.len ? hm->query_string.p : "");
+        } else {
+            mg_http_send_error(c, 404, NULL);
+        }
+        return 1;
+    }
+    if (e->kind == INDEX_PASSTHROUGH) return 0;
+
+    struct mg_serve_http_opts opts;
+    struct mg_str mime = MG_NULL_STR, encoding = MG_NULL_STR;
+    memset(&opts, 0, sizeof(opts));
+    if (!mg_get_mime_type_encoding(mg_mk_str(e->path), &mime, &encoding, &opts))
+        mime = mg_mk_str("text/plain");
+
+    /* Without a watch the metadata may be stale, so only trust it for
+     * validators while the index is kept up to date. */
+    cs_stat_t st, gzst;
+    memset(&st, 0, sizeof(st));
+    memset(&gzst, 0, sizeof(gzst));
+    st.st_ino = e->ino;
+    st.st_size = e->size;
+    st.st_mtime = e->mtime;
+    gzst.st_ino = e->gz_ino;
+    gzst.st_size = e->gz_size;
+    gzst.st_mtime = e->gz_mtime;
+    int fresh = ix->inotify_fd >= 0;
+    serve_resolved(c, hm, key, rootlen + 3 + ulen, e->path, e->has_gz, mime, encoding,
+                   fresh ? &st : NULL, fresh ? &gzst : NULL);
+    return 1;
+}
+
+#endif
+
+static int connection_mark(void *p, size_t size) {
+    (void) size;
+    ConnectionWrapper *cw = (ConnectionWrapper *)p;
+    struct mg_connection *conn = cw->conn;
+    JanetFiber *fiber = cw->fiber;
+    janet_mark(janet_wrap_fiber(fiber));
+    if (cw->on_writable) janet_mark(janet_wrap_function(cw->on_writable));
+    if (cw->ws_handler) janet_mark(janet_wrap_function(cw->ws_handler));
+    if (cw->ws_fiber) janet_mark(janet_wrap_fiber(cw->ws_fiber));
+    janet_mark(cw->ws_state);
+    if (conn) janet_mark(janet_wrap_abstract(conn->mgr));
+    return 0;
+}
+
+static struct JanetAbstractType Connection_jt = {
+    "mongoose.connection",
+    NULL,
+    connection_mark,
+#ifdef JANET_ATEND_GCMARK
+    JANET_ATEND_GCMARK
+#endif
+};
+
+static int manager_gc(void *p, size_t size) {
+    (void) size;
+    Manager *m = (Manager *)p;
+    mg_mgr_free(&m->mgr);
+    cache_deinit(&m->file_cache);
+    cache_deinit(&m->compress_cache);
+    path_info_clear(m);
+    validator_clear(m);
+    map_deinit(&m->sse_channels);
+    map_deinit(&m->ws_topics);
+    free(m->ws_separator);
+#if CIRCLET_ENABLE_ZLIB
+    if (m->ws_deflater) deflateEnd(m->ws_deflater);
+    if (m->ws_inflater) inflateEnd(m->ws_inflater);
+    free(m->ws_deflater);
+    free(m->ws_inflater);
+    free(m->ws_deflated.data);
+    free(m->ws_inflated.data);
+#endif
+#ifndef _WIN32
+    while (m->indexes) {
+        StaticIndex *next = m->indexes->next;
+        index_free(m->indexes);
+        m->indexes = next;
+    }
+#endif
+    return 0;
+}
+
+static int manager_mark(void *p, size_t size) {
+    (void) size;
+    struct mg_mgr *mgr = (struct mg_mgr *)p;
+    /* Iterate all connections, and mark then */
+    struct mg_connection *conn = mgr->active_connections;
+    while (conn) {
+        ConnectionWrapper *cw = conn->user_data;
+        if (cw) {
+            janet_mark(janet_wrap_abstract(cw));
+        }
+        if (conn->flags & CIRCLET_F_STREAM) {
+            janet_mark(janet_wrap_fiber(((Stream *) conn->priv_2)->fiber));
+        }
+        conn = conn->next;
+    }
+    return 0;
+}
+
+static struct JanetAbstractType Manager_jt = {
+    "mongoose.manager",
+    manager_gc,
+    manager_mark,
+#ifdef JANET_ATEND_GCMARK
+    JANET_ATEND_GCMARK
+#endif
+};
+
+static Janet mg2janetstr(struct mg_str str) {
+    return janet_stringv((const uint8_t *) str.p, str.len);
+}
+
+/* Turn a string value into c string */
+static const char *getstring(Janet x, const char *dflt) {
+    if (janet_checktype(x, JANET_STRING)) {
+        const uint8_t *bytes = janet_unwrap_string(x);
+        return (const char *)bytes;
+    } else {
+        return dflt;
+    }
+}
+
+static Janet build_http_request(struct mg_connection *c, struct http_message *hm) {
+    JanetTable *payload = janet_table(10);
+    janet_table_put(payload, janet_ckeywordv("body"), mg2janetstr(hm->body));
+    janet_table_put(payload, janet_ckeywordv("uri"), mg2janetstr(hm->uri));
+    janet_table_put(payload, janet_ckeywordv("query-string"), mg2janetstr(hm->query_string));
+    janet_table_put(payload, janet_ckeywordv("method"), mg2janetstr(hm->method));
+    janet_table_put(payload, janet_ckeywordv("protocol"), mg2janetstr(hm->proto));
+    janet_table_put(payload, janet_ckeywordv("connection"), janet_wrap_abstract(c->user_data));
+    /* Add headers */
+    JanetTable *headers = janet_table(5);
+    for (int i = 0; i < MG_MAX_HTTP_HEADERS; i++) {
+        if (hm->header_names[i].len == 0)
+            break;
+        Janet key = mg2janetstr(hm->header_names[i]);
+        Janet value = mg2janetstr(hm->header_values[i]);
+        Janet header = janet_table_get(headers, key);
+        switch (janet_type(header)) {
+            case JANET_NIL:
+                janet_table_put(headers, key, value);
+                break;
+            case JANET_ARRAY:
+                janet_array_push(janet_unwrap_array(header), value);
+                break;
+            default:
+                {
+                    Janet newHeader[2] = { header, value };
+                    janet_table_put(headers, key, janet_wrap_array(janet_array_n(newHeader, 2)));
+                    break;
+                }
+        }
+    }
+    janet_table_put(payload, janet_ckeywordv("headers"), janet_wrap_table(headers));
+    return janet_wrap_table(payload);
+}
+
+/* Send one response header line. With retag, the value is an entity tag
+ * that gets a -gzip suffix inside its closing quote. */
+static void send_header(struct mg_connection *c, const uint8_t *name,
+        const uint8_t *value, int retag) {
+    size_t len = strlen((const char *) value);
+    if (retag && len >= 2 && value[len - 1] == '"') {
+        mg_printf(c, "%s: %.*s-gzip\"\r\n", (const char *) name, (int) len - 1, (const char *) value);
+    } else if (retag) {
+        mg_printf(c, "%s: %s-gzip\r\n", (const char *) name, (const char *) value);
+    } else {
+        mg_printf(c, "%s: %s\r\n", (const char *) name, (const char *) value);
+    }
+}
+
+/* Send the headers of a response. With gzipped, entity tags are given the
+ * -gzip suffix. */
+static void send_headers(struct mg_connection *c, const JanetKV *headerkvs,
+        int32_t headercap, int gzipped) {
+    for (const JanetKV *kv = janet_dictionary_next(headerkvs, headercap, NULL);
+            kv;
+            kv = janet_dictionary_next(headerkvs, headercap, kv)) {
+        const uint8_t *name = janet_to_string(kv->key);
+        /* A compressed body is a different representation, so it
+         * must not share an entity tag with the plain one. */
+        int retag = gzipped && !mg_casecmp((const char *) name, "ETag");
+        int32_t header_len;
+        const Janet *header_items;
+        if (janet_indexed_view(kv->value, &header_items, &header_len)) {
+            /* Array-like of headers */
+            for (int32_t i = 0; i < header_len; i++) {
+                const uint8_t *value = janet_to_string(header_items[i]);
+                send_header(c, name, value, retag);
+            }
+        } else {
+            /* Single header */
+            const uint8_t *value = janet_to_string(kv->value);
+            send_header(c, name, value, retag);
+        }
+    }
+}
+
+static void stream_free(struct mg_connection *c) {
+    if (!(c->flags & CIRCLET_F_STREAM)) return;
+    free(c->priv_2);
+    c->priv_2 = NULL;
+    c->flags &= ~CIRCLET_F_STREAM;
+}
+
+/* Resume the body fiber of a :stream response until the send buffer fills
+ * up to the send low water mark or the fiber finishes. Each string or buffer it
+ * yields or returns is sent as a chunk, nil is skipped. */
+static void stream_pump(struct mg_connection *c) {
+    size_t low_water = ((Manager *) c->mgr)->send_low_water;
+    while ((c->flags & CIRCLET_F_STREAM) && c->send_mbuf.len < low_water) {
+        Stream *s = (Stream *) c->priv_2;
+        Janet out;
+        const uint8_t *bytes;
+        int32_t len;
+        int failed = 0;
+        JanetSignal status = janet_continue(s->fiber, janet_wrap_nil(), &out);
+        if (status != JANET_SIGNAL_OK && status != JANET_SIGNAL_YIELD) {
+            janet_stacktrace(s->fiber, out);
+            failed = 1;
+        } else if (janet_bytes_view(out, &bytes, &len)) {
+            if (len && s->chunked) mg_printf(c, "%lx\r\n", (unsigned long) len);
+            mg_send(c, bytes, len);
+            if (len && s->chunked) mg_send(c, "\r\n", 2);
+        } else if (!janet_checktype(out, JANET_NIL)) {
+            janet_eprintf("expected string or buffer from :stream body, got %v\n", out);
+            failed = 1;
+        }
+        if (status == JANET_SIGNAL_YIELD && !failed) continue;
+        /* Leave off the last chunk when the body fails, so that the client
+         * can tell it is incomplete */
+        if (!failed && s->chunked) mg_send(c, "0\r\n\r\n", 5);
+        c->flags |= MG_F_SEND_AND_CLOSE;
+        stream_free(c);
+    }
+}
+
+/* Send the head of a :stream response and start pulling its body. The body
+ * is a fiber, or a function to run in a new one. */
+static void stream_start(struct mg_connection *c, struct http_message *hm, int code,
+        const JanetKV *headerkvs, int32_t headercap, Janet body) {
+    JanetFiber *fiber;
+    Stream *s;
+    if (janet_checktype(body, JANET_FIBER)) {
+        fiber = janet_unwrap_fiber(body);
+    } else if (janet_checktype(body, JANET_FUNCTION)) {
+        fiber = janet_fiber(janet_unwrap_function(body), 64, 0, NULL);
+    } else {
+        fiber = NULL;
+    }
+    if (!fiber || !(s = malloc(sizeof(Stream)))) {
+        mg_send_head(c, 500, 0, "");
+        c->flags |= MG_F_SEND_AND_CLOSE;
+        return;
+    }
+    /* HTTP/1.0 clients get the raw body, ended by closing the connection */
+    s->fiber = fiber;
+    s->chunked = !mg_vcmp(&hm->proto, "HTTP/1.1");
+    send_status(c, code);
+    send_headers(c, headerkvs, headercap, 0);
+    if (s->chunked) mg_printf(c, "Transfer-Encoding: chunked\r\n");
+    mg_printf(c, "\r\n");
+    if (!mg_vcmp(&hm->method, "HEAD")) {
+        free(s);
+        c->flags |= MG_F_SEND_AND_CLOSE;
+        return;
+    }
+    c->priv_2 = s;
+    c->flags |= CIRCLET_F_STREAM;
+    stream_pump(c);
+}
+
+/* Send the head of an :sse response and subscribe the connection to its
+ * channel. The connection stays open, without a length or chunking, until
+ * the client goes away. An initial :body, such as events missed since the
+ * client's Last-Event-ID, is sent as is. */
+static void sse_start(struct mg_connection *c, struct http_message *hm,
+        const JanetKV *kvs, int32_t kvcap) {
+    Janet channel = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("channel"));
+    Janet headers = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("headers"));
+    Janet body = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("body"));
+    const uint8_t *name, *bodybytes = NULL, *value;
+    int32_t namelen, bodylen = 0, headerlen, headercap = 0, valuelen;
+    const JanetKV *headerkvs = NULL;
+    if (!janet_bytes_view(channel, &name, &namelen) ||
+            (!janet_checktype(headers, JANET_NIL) &&
+             !janet_dictionary_view(headers, &headerkvs, &headerlen, &headercap)) ||
+            (!janet_checktype(body, JANET_NIL) && !janet_bytes_view(body, &bodybytes, &bodylen))) {
+        mg_send_head(c, 500, 0, "");
+        c->flags |= MG_F_SEND_AND_CLOSE;
+        return;
+    }
+    send_status(c, 200);
+    if (!response_header(headerkvs, headercap, "Content-Type", &value, &valuelen))
+        mg_printf(c, "Content-Type: text/event-stream\r\n");
+    if (!response_header(headerkvs, headercap, "Cache-Control", &value, &valuelen))
+        mg_printf(c, "Cache-Control: no-cache\r\n");
+    send_headers(c, headerkvs, headercap, 0);
+    mg_printf(c, "\r\n");
+    if (!mg_vcmp(&hm->method, "HEAD")) {
+        c->flags |= MG_F_SEND_AND_CLOSE;
+        return;
+    }
+    if (bodylen) mg_send(c, bodybytes, bodylen);
+    if (!sse_subscribe(c, name, namelen)) c->flags |= MG_F_SEND_AND_CLOSE;
+}
+
+/* Send an HTTP reply. This should try not to panic, as at this point we
+ * are outside of the janet interpreter. Instead, send a 500 response with
+ * some formatted error message. */
+static void send_http(struct mg_connection *c, Janet res, void *ev_data) {
+    switch (janet_type(res)) {
+        default:
+            mg_send_head(c, 500, 0, "");
+            break;
+        case JANET_TABLE:
+        case JANET_STRUCT:
+            {
+                const JanetKV *kvs;
+                int32_t kvlen, kvcap;
+                janet_dictionary_view(res, &kvs, &kvlen, &kvcap);
+
+                /* Get response kind and check for special handling methods. */
+                Janet kind = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("kind"));
+                int streaming = 0;
+                if (janet_checktype(kind, JANET_KEYWORD)) {
+                    const uint8_t *kindstr = janet_unwrap_keyword(kind);
+
+                    /* Check for serving static files */
+                    if (!janet_cstrcmp(kindstr, "static")) {
+                        /* Construct static serve options */
+                        struct mg_serve_http_opts opts;
+                        memset(&opts, 0, sizeof(opts));
+                        Janet root = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("root"));
+                        opts.document_root = getstring(root, NULL);
+#ifndef _WIN32
+                        if (index_serve_static(c, (struct http_message *) ev_data,
+                                    opts.document_root ? opts.document_root : "."))
+                            return;
+#endif
+                        if (serve_static_file(c, (struct http_message *) ev_data,
+                                    opts.document_root ? opts.document_root : "."))
+                            return;
+                        mg_serve_http(c, (struct http_message *) ev_data, opts);
+                        return;
+                    }
+
+                    /* Check for serving single file */
+                    if (!janet_cstrcmp(kindstr, "file")) {
+                        Janet filev = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("file"));
+                        Janet mimev = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("mime"));
+                        const char *mime = getstring(mimev, "text/plain");
+                        const char *filepath;
+                        if (!janet_checktype(filev, JANET_STRING)) {
+                            mg_send_head(c, 500, 0, "expected string :file option to serve a file");
+                            break;
+                        }
+                        filepath = getstring(filev, "");
+                        serve_file(c, (struct http_message *)ev_data, filepath, mime);
+                        return;
+                    }
+
+                    /* Check for a Server-Sent Events subscription */
+                    if (!janet_cstrcmp(kindstr, "sse")) {
+                        sse_start(c, (struct http_message *) ev_data, kvs, kvcap);
+                        return;
+                    }
+
+                    streaming = !janet_cstrcmp(kindstr, "stream");
+                }
+
+                /* Serve a generic HTTP response */
+
+                Janet status = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("status"));
+                Janet headers = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("headers"));
+                Janet body = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("body"));
+
+                int code;
+                if (janet_checktype(status, JANET_NIL))
+                    code = 200;
+                else if (janet_checkint(status))
+                    code = janet_unwrap_integer(status);
+                else
+                    break;
+
+                const JanetKV *headerkvs;
+                int32_t headerlen, headercap;
+                if (janet_checktype(headers, JANET_NIL)) {
+                    headerkvs = NULL;
+                    headerlen = 0;
+                    headercap = 0;
+                } else if (!janet_dictionary_view(headers, &headerkvs, &headerlen, &headercap)) {
+                    break;
+                }
+
+                /* Check for a body streamed from a fiber */
+                if (streaming) {
+                    stream_start(c, (struct http_message *) ev_data, code, headerkvs, headercap, body);
+                    return;
+                }
+
+                const uint8_t *bodybytes;
+                int32_t bodylen;
+                if (janet_checktype(body, JANET_NIL)) {
+                    bodybytes = NULL;
+                    bodylen = 0;
+                } else if (!janet_bytes_view(body, &bodybytes, &bodylen)) {
+                    break;
+                }
+
+                struct http_message *hm = (struct http_message *) ev_data;
+                Manager *m = (Manager *) c->mgr;
+                const uint8_t *value;
+                int32_t valuelen;
+
+                /* The entity tag comes from :etag, or else an ETag header.
+                 * A bare :etag is quoted. */
+                Janet etagv = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("etag"));
+                char etag[CIRCLET_MAX_KEY];
+                size_t etaglen = 0;
+                int have_etag = 0, send_etag = 0;
+                if (!janet_checktype(etagv, JANET_NIL)) {
+                    if (!janet_bytes_view(etagv, &value, &valuelen)) break;
+                    have_etag = send_etag = 1;
+                } else {
+                    have_etag = response_header(headerkvs, headercap, "ETag", &value, &valuelen);
+                }
+                if (have_etag && (size_t) valuelen + 3 < sizeof(etag)) {
+                    if (valuelen && (value[0] == '"' || (valuelen > 1 && value[0] == 'W' && value[1] == '/')))
+                        etaglen = snprintf(etag, sizeof(etag), "%.*s", (int) valuelen, (const char *) value);
+                    else
+                        etaglen = snprintf(etag, sizeof(etag), "\"%.*s\"", (int) valuelen, (const char *) value);
+                } else {
+                    send_etag = 0;
+                }
+                time_t mtime = 0;
+                if (response_header(headerkvs, headercap, "Last-Modified", &value, &valuelen) &&
+                        valuelen < 64) {
+                    char date[64];
+                    memcpy(date, value, valuelen);
+                    date[valuelen] = '\0';
+                    mtime = mg_parse_date_string(date);
+                }
+
+                /* Compress the body if enabled for this response, the client
+                 * takes gzip, and the body is not already encoded. */
+                const char *sendbytes = (const char *) bodybytes;
+                size_t sendlen = (size_t) bodylen;
+                int vary = 0, want_gzip = 0, gzipped = 0, owned = 0;
+#if CIRCLET_ENABLE_ZLIB
+                Janet compressv = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("compress"));
+                int compress = janet_checktype(compressv, JANET_NIL) ? m->compress : janet_truthy(compressv);
+                if (compress && code >= 200 && code != 204 && code != 206 && code != 304 &&
+                        !response_header(headerkvs, headercap, "Content-Encoding", &value, &valuelen)) {
+                    int typed = response_header(headerkvs, headercap, "Content-Type", &value, &valuelen);
+                    if (compressible_type(typed ? value : NULL, valuelen) &&
+                            (size_t) bodylen >= m->compress_min_size) {
+                        vary = 1;
+                        want_gzip = accepts_gzip(hm);
+                    }
+                }
+#endif
+
+                /* Answer revalidations before doing any work on the body */
+                if (code == 200 && not_modified(hm, etaglen ? etag : NULL, etaglen, want_gzip, mtime)) {
+                    char gzetag[CIRCLET_MAX_KEY + 8];
+                    const char *tag = etag;
+                    if (want_gzip && etaglen && etag[etaglen - 1] == '"') {
+                        etaglen = snprintf(gzetag, sizeof(gzetag), "%.*s-gzip\"", (int) etaglen - 1, etag);
+                        tag = gzetag;
+                    }
+                    send_not_modified(c, hm, etaglen ? tag : NULL, etaglen,
+                                      mg_mk_str(vary ? "Vary: Accept-Encoding" : NULL));
+                    break;
+                }
+
+#if CIRCLET_ENABLE_ZLIB
+                if (want_gzip) {
+                    const char *z = compress_body(m, hm, etaglen ? etag : NULL, (int32_t) etaglen,
+                                                  bodybytes, bodylen, &sendlen, &owned);
+                    if (z) {
+                        sendbytes = z;
+                        gzipped = 1;
+                    } else {
+                        sendlen = (size_t) bodylen;
+                    }
+                }
+#endif
+
+                send_status(c, code);
+                send_headers(c, headerkvs, headercap, gzipped);
+
+                if (send_etag) send_header(c, (const uint8_t *) "ETag", (const uint8_t *) etag, gzipped);
+                if (gzipped) mg_printf(c, "Content-Encoding: gzip\r\n");
+                if (vary) mg_printf(c, "Vary: Accept-Encoding\r\n");
+                mg_printf(c, "Content-Length: %d\r\n", (int) sendlen);
+                mg_printf(c, "\r\n");
+                if (sendlen) mg_send(c, sendbytes, (int) sendlen);
+                if (owned) free((char *) sendbytes);
+                if (code == 200 && etaglen && etag[etaglen - 1] == '"') {
+                    if (gzipped) {
+                        char gzetag[CIRCLET_MAX_KEY + 8];
+                        int n = snprintf(gzetag, sizeof(gzetag), "%.*s-gzip\"", (int) etaglen - 1, etag);
+                        validator_store(m, hm, gzetag, n, vary);
+                    } else {
+                        validator_store(m, hm, etag, etaglen, vary);
+                    }
+                }
+            }
+            break;
+    }
+    mg_printf(c, "\r\n");
+    c->flags |= MG_F_SEND_AND_CLOSE;
+}
+
+/* The RSV1 bit, set on the first frame of a compressed message */
+#define CIRCLET_WS_DEFLATED 0x40
+
+/* What to do with a message for a websocket connection whose queue is full */
+#define CIRCLET_WS_QUEUE_CLOSE 0
+#define CIRCLET_WS_QUEUE_DROP_OLDEST 1
+#define CIRCLET_WS_QUEUE_DROP_NEWEST 2
+
+/* What a connection agreed on in its permessage-deflate handshake */
+#define CIRCLET_WS_DEFLATE 1
+#define CIRCLET_WS_CLIENT_NO_TAKEOVER 2
+
+static const char *const ws_opcodes[16] = {
+    "continuation", "text", "binary", NULL, NULL, NULL, NULL, NULL,
+    "close", "ping", "pong", NULL, NULL, NULL, NULL, NULL
+};
+
+static Janet ws_opcodev(int op) {
+    const char *name = ws_opcodes[op & 0x0f];
+    return name ? janet_ckeywordv(name) : janet_wrap_integer(op & 0x0f);
+}
+
+/* Encode the header of a server to client websocket frame into header,
+ * which must have room for 10 bytes. Frames from a server are never
+ * masked, so the same bytes can go to every connection. */
+static size_t ws_header(unsigned char *header, int op, size_t len) {
+    header[0] = (unsigned char) ((op & WEBSOCKET_DONT_FIN ? 0 : 0x80) | (op & (CIRCLET_WS_DEFLATED | 0x0f)));
+    if (len < 126) {
+        header[1] = (unsigned char) len;
+        return 2;
+    } else if (len < 65536) {
+        header[1] = 126;
+        header[2] = (unsigned char) (len >> 8);
+        header[3] = (unsigned char) len;
+        return 4;
+    }
+    header[1] = 127;
+    for (int i = 0; i < 8; i++)
+        header[2 + i] = (unsigned char) ((uint64_t) len >> (56 - 8 * i));
+    return 10;
+}
+
+/* Room, past the largest message allowed, for the header of a partial frame,
+ * a control frame in between and one read from the socket */
+#define CIRCLET_WS_SLACK 4096
+
+/* Seconds a websocket connection closed by the server has to take the close
+ * frame before it is dropped */
+#define CIRCLET_WS_CLOSE_GRACE 1.0
+
+/* Refuse a message over the size limit of its connection: close with 1009,
+ * message too big, and read nothing more so the rest is never buffered */
+static void ws_close_too_big(struct mg_connection *c) {
+    if (c->flags & MG_F_SEND_AND_CLOSE) return;
+    mg_send_websocket_frame(c, WEBSOCKET_OP_CLOSE, "\x03\xf1", 2);
+    c->recv_mbuf_limit = 0;
+}
+
+/* Check what has arrived on a websocket connection against its size limit
+ * before mongoose waits for a whole frame. Streamed connections have nothing
+ * reassembled in front of their frames, so every header can be read; on the
+ * others only the buffer as a whole can be bounded. */
+static void ws_check_size(struct mg_connection *c) {
+    ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+    if (!cw || cw->conn != c || !cw->ws_max_message) return;
+    size_t max = cw->ws_max_message;
+    if (!(c->flags & MG_F_WEBSOCKET_NO_DEFRAG)) {
+        if (c->recv_mbuf.len > max + CIRCLET_WS_SLACK) ws_close_too_big(c);
+        return;
+    }
+    const unsigned char *p = (const unsigned char *) c->recv_mbuf.buf;
+    size_t left = c->recv_mbuf.len;
+    while (left >= 2) {
+        size_t header = 2 + (p[1] & 0x80 ? 4 : 0), extra = 0;
+        uint64_t len = p[1] & 0x7f;
+        if (len == 126) extra = 2;
+        if (len == 127) extra = 8;
+        if (left < header + extra) return;
+        if (extra) len = 0;
+        for (size_t i = 0; i < extra; i++) len = (len << 8) | p[2 + i];
+        header += extra;
+        if (len > max) {
+            ws_close_too_big(c);
+            return;
+        }
+        if (len >= left - header) return;
+        p += header + len;
+        left -= header + (size_t) len;
+    }
+}
+
+static WsFrame *ws_frame_new(int op, const uint8_t *payload, size_t len) {
+    unsigned char header[10];
+    size_t header_len = ws_header(header, op, len);
+    WsFrame *f = malloc(sizeof(WsFrame) + header_len + len);
+    if (!f) JANET_OUT_OF_MEMORY;
+    f->refcount = 0;
+    f->len = header_len + len;
+    memcpy(f->data, header, header_len);
+    if (payload && len) memcpy(f->data + header_len, payload, len);
+    return f;
+}
+
+static size_t ws_frame_header_len(const WsFrame *f) {
+    size_t len = f->data[1] & 0x7f;
+    return len == 127 ? 10 : len == 126 ? 4 : 2;
+}
+
+static void ws_frame_release(WsFrame *f) {
+    if (--f->refcount == 0) free(f);
+}
+
+static void ws_queue_push(WsQueue *q, WsFrame *f) {
+    if (q->count == q->capacity) {
+        size_t capacity = q->capacity ? 2 * q->capacity : 8;
+        WsFrame **frames = malloc(capacity * sizeof(WsFrame *));
+        if (!frames) JANET_OUT_OF_MEMORY;
+        for (size_t i = 0; i < q->count; i++)
+            frames[i] = q->frames[(q->head + i) % q->capacity];
+        free(q->frames);
+        q->frames = frames;
+        q->head = 0;
+        q->capacity = capacity;
+    }
+    q->frames[(q->head + q->count) % q->capacity] = f;
+    q->count++;
+    q->bytes += f->len;
+    f->refcount++;
+}
+
+static void ws_queue_pop(WsQueue *q) {
+    WsFrame *f = q->frames[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    q->bytes -= f->len;
+    ws_frame_release(f);
+}
+
+static void ws_queue_clear(WsQueue *q) {
+    while (q->count) ws_queue_pop(q);
+    free(q->frames);
+    q->frames = NULL;
+    q->capacity = 0;
+}
+
+/* Merge each run of whole, uncompressed messages of one opcode in a queue
+ * into a single frame, their payloads joined by sep. The application has
+ * to be able to split them again, so this only happens when it asks. */
+static void ws_queue_merge(WsQueue *q, const uint8_t *sep, size_t seplen) {
+    WsQueue merged;
+    memset(&merged, 0, sizeof(merged));
+    size_t i = 0;
+    while (i < q->count) {
+        WsFrame *f = q->frames[(q->head + i) % q->capacity];
+        int first = f->data[0];
+        size_t j = i + 1, len = f->len - ws_frame_header_len(f);
+        if (first == 0x81 || first == 0x82) {
+            for (; j < q->count; j++) {
+                WsFrame *g = q->frames[(q->head + j) % q->capacity];
+                if (g->data[0] != first) break;
+                len += seplen + g->len - ws_frame_header_len(g);
+            }
+        }
+        if (j == i + 1) {
+            ws_queue_push(&merged, f);
+        } else {
+            WsFrame *out = ws_frame_new(first & 0x0f, NULL, len);
+            unsigned char *p = out->data + out->len - len;
+            for (size_t k = i; k < j; k++) {
+                WsFrame *g = q->frames[(q->head + k) % q->capacity];
+                size_t header_len = ws_frame_header_len(g);
+                if (k > i && seplen) {
+                    memcpy(p, sep, seplen);
+                    p += seplen;
+                }
+                memcpy(p, g->data + header_len, g->len - header_len);
+                p += g->len - header_len;
+            }
+            ws_queue_push(&merged, out);
+        }
+        i = j;
+    }
+    ws_queue_clear(q);
+    *q = merged;
+}
+
+#if CIRCLET_ENABLE_ZLIB
+
+/* Whether a message to a connection should go out compressed. Fragmented
+ * messages are always sent as they are. */
+static int ws_compressible(Manager *m, ConnectionWrapper *cw, int op, size_t len) {
+    return (cw->ws_flags & CIRCLET_WS_DEFLATE) && !(op & WEBSOCKET_DONT_FIN) &&
+        ((op & 0x0f) == WEBSOCKET_OP_TEXT || (op & 0x0f) == WEBSOCKET_OP_BINARY) &&
+        len >= m->ws_deflate_min_size;
+}
+
+static unsigned char *ws_scratch(WsScratch *scratch, size_t size) {
+    if (size > scratch->size) {
+        unsigned char *data = realloc(scratch->data, size);
+        if (!data) JANET_OUT_OF_MEMORY;
+        scratch->data = data;
+        scratch->size = size;
+    }
+    return scratch->data;
+}
+
+/* Compress a message into the deflate scratch buffer of the manager. The server
+ * never takes over its context, so each message starts from a fresh window
+ * and one compressed frame can be shared by every connection. Returns the
+ * compressed length, or 0 if compressing did not pay off. */
+static size_t ws_deflate(Manager *m, const uint8_t *data, size_t len) {
+    z_stream *zs = m->ws_deflater;
+    if (zs) {
+        deflateReset(zs);
+    } else {
+        zs = calloc(1, sizeof(z_stream));
+        if (!zs) return 0;
+        if (deflateInit2(zs, m->compress_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(zs);
+            return 0;
+        }
+        m->ws_deflater = zs;
+    }
+    size_t cap = deflateBound(zs, (uLong) len) + 16;
+    zs->next_in = (Bytef *) data;
+    zs->avail_in = (uInt) len;
+    zs->next_out = ws_scratch(&m->ws_deflated, cap);
+    zs->avail_out = (uInt) cap;
+    if (deflate(zs, Z_SYNC_FLUSH) != Z_OK || zs->avail_in || !zs->avail_out) return 0;
+    /* A sync flush ends in an empty stored block, which is left off the wire */
+    size_t n = cap - zs->avail_out;
+    if (n < 4 || n - 4 >= len) return 0;
+    return n - 4;
+}
+
+/* Inflate a compressed message, or one frame of it, into the inflate scratch
+ * buffer of the manager. Connections that let the client keep its context
+ * need an inflater of their own, the others share one for whole messages.
+ * Returns 0 on corrupt data and -1 if the output grows past room. */
+static int ws_inflate(struct mg_connection *c, const uint8_t *data, size_t len,
+        int first, int fin, size_t room, size_t *outlen) {
+    static const uint8_t tail[4] = {0, 0, 0xff, 0xff};
+    Manager *m = (Manager *) c->mgr;
+    ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+    int no_takeover = cw->ws_flags & CIRCLET_WS_CLIENT_NO_TAKEOVER;
+    /* A streamed message keeps its window from one frame to the next */
+    int shared = no_takeover && first && fin;
+    z_stream **slot = shared ? &m->ws_inflater : &cw->ws_inflater;
+    z_stream *zs = *slot;
+    if (zs && no_takeover && first) {
+        inflateReset(zs);
+    } else if (!zs) {
+        zs = calloc(1, sizeof(z_stream));
+        if (!zs) return 0;
+        if (inflateInit2(zs, -15) != Z_OK) {
+            free(zs);
+            return 0;
+        }
+        *slot = zs;
+    }
+    size_t size = 0, cap = len * 4 + 64;
+    /* The tail the client left off only follows the final frame */
+    for (int part = 0; part < (fin ? 2 : 1); part++) {
+        zs->next_in = (Bytef *) (part ? tail : data);
+        zs->avail_in = (uInt) (part ? sizeof(tail) : len);
+        do {
+            if (size == cap) cap *= 2;
+            unsigned char *out = ws_scratch(&m->ws_inflated, cap);
+            zs->next_out = out + size;
+            zs->avail_out = (uInt) (cap - size);
+            int status = inflate(zs, Z_SYNC_FLUSH);
+            size = cap - zs->avail_out;
+            if (size > room) return -1;
+            if (status == Z_STREAM_END) {
+                /* The client ended its stream, the next message starts anew */
+                inflateReset(zs);
+                *outlen = size;
+                return 1;
+            }
+            if (status != Z_OK && status != Z_BUF_ERROR) return 0;
+        } while (!zs->avail_out);
+    }
+    *outlen = size;
+    return 1;
+}
+
+/* Pick the first permessage-deflate offer in a Sec-WebSocket-Extensions
+ * header that can be accepted. Offers asking for a smaller server window
+ * are declined, compressed frames are shared and all use the full window.
+ * Returns the CIRCLET_WS_* flags to keep, or 0. */
+static int ws_deflate_offer(struct mg_str header, int no_context_takeover) {
+    const char *p = header.p, *end = header.p + header.len;
+    while (p < end) {
+        const char *offer_end = memchr(p, ',', end - p);
+        if (!offer_end) offer_end = end;
+        int flags = CIRCLET_WS_DEFLATE | (no_context_takeover ? CIRCLET_WS_CLIENT_NO_TAKEOVER : 0);
+        int ok = 1, first = 1;
+        for (; ok && p < offer_end; first = 0) {
+            const char *param_end = memchr(p, ';', offer_end - p);
+            if (!param_end) param_end = offer_end;
+            struct mg_str name = mg_mk_str_n(p, param_end - p), value = mg_mk_str_n(NULL, 0);
+            const char *eq = memchr(p, '=', param_end - p);
+            if (eq) {
+                name.len = eq - p;
+                value = mg_strstrip(mg_mk_str_n(eq + 1, param_end - eq - 1));
+                if (value.len >= 2 && value.p[0] == '"' && value.p[value.len - 1] == '"')
+                    value = mg_mk_str_n(value.p + 1, value.len - 2);
+            }
+            name = mg_strstrip(name);
+            if (first) {
+                ok = !eq && !mg_vcasecmp(&name, "permessage-deflate");
+            } else if (!mg_vcasecmp(&name, "server_no_context_takeover")) {
+                ok = !eq;
+            } else if (!mg_vcasecmp(&name, "client_no_context_takeover")) {
+                ok = !eq;
+                flags |= CIRCLET_WS_CLIENT_NO_TAKEOVER;
+            } else if (!mg_vcasecmp(&name, "server_max_window_bits")) {
+                ok = eq && !mg_vcmp(&value, "15");
+            } else {
+                ok = !mg_vcasecmp(&name, "client_max_window_bits");
+            }
+            p = param_end + 1;
+        }
+        if (ok && !first) return flags;
+        p = offer_end + 1;
+    }
+    return 0;
+}
+
+/* Answer a websocket upgrade that offers permessage-deflate. mongoose does
+ * not know about extensions, but leaves the handshake to the handler if it
+ * puts one in send_mbuf. Otherwise mongoose answers as usual. */
+static void ws_handshake(struct mg_connection *c, struct http_message *hm) {
+    static const char magic[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    Manager *m = (Manager *) c->mgr;
+    ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+    struct mg_str *key = mg_get_http_header(hm, "Sec-WebSocket-Key");
+    struct mg_str *ext = mg_get_http_header(hm, "Sec-WebSocket-Extensions");
+    if (!m->ws_deflate || !key || !ext || !cw || cw->conn != c || c->send_mbuf.len) return;
+    int flags = ws_deflate_offer(*ext, m->ws_no_context_takeover);
+    if (!flags) return;
+    const uint8_t *msgs[2] = {(const uint8_t *) key->p, (const uint8_t *) magic};
+    const size_t lens[2] = {key->len, sizeof(magic) - 1};
+    unsigned char sha[20];
+    char accept[32];
+    mg_hash_sha1_v(2, msgs, lens, sha);
+    mg_base64_encode(sha, sizeof(sha), accept);
+    mg_printf(c, "HTTP/1.1 101 Switching Protocols\r\n"
+              "Upgrade: websocket\r\n"
+              "Connection: Upgrade\r\n");
+    struct mg_str *protocol = mg_get_http_header(hm, "Sec-WebSocket-Protocol");
+    if (protocol) mg_printf(c, "Sec-WebSocket-Protocol: %.*s\r\n", (int) protocol->len, protocol->p);
+    mg_printf(c, "Sec-WebSocket-Extensions: permessage-deflate; server_no_context_takeover%s\r\n"
+              "Sec-WebSocket-Accept: %s\r\n\r\n",
+              flags & CIRCLET_WS_CLIENT_NO_TAKEOVER ? "; client_no_context_takeover" : "", accept);
+    cw->ws_flags = flags;
+}
+
+/* Replace a compressed message, or a frame of a streamed one, with its
+ * inflated form. Returns NULL, and closes the connection, if the message
+ * cannot be inflated or inflates to more than room bytes. */
+static struct websocket_message *ws_inflate_message(struct mg_connection *c,
+        struct websocket_message *wm, int first, size_t room, struct websocket_message *out) {
+    ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+    size_t len;
+    if (!cw || cw->conn != c || !(cw->ws_flags & CIRCLET_WS_DEFLATE)) {
+        /* 1002, protocol error: RSV1 was not negotiated */
+        mg_send_websocket_frame(c, WEBSOCKET_OP_CLOSE, "\x03\xea", 2);
+        return NULL;
+    }
+    int status = ws_inflate(c, wm->data, wm->size, first, wm->flags & 0x80, room, &len);
+    if (status < 0) {
+        ws_close_too_big(c);
+        return NULL;
+    }
+    if (!status) {
+        /* 1007, invalid payload data */
+        mg_send_websocket_frame(c, WEBSOCKET_OP_CLOSE, "\x03\xef", 2);
+        return NULL;
+    }
+    out->data = ((Manager *) c->mgr)->ws_inflated.data;
+    out->size = len;
+    out->flags = wm->flags & ~CIRCLET_WS_DEFLATED;
+    return out;
+}
+
+#endif
+
+/* A message on its way to several connections. Its plain and compressed
+ * frames are each built the first time a connection needs them. */
+typedef struct {
+    int op;
+    const uint8_t *data;
+    size_t len;
+    WsFrame *plain;
+    WsFrame *deflated;
+} WsMessage;
+
+static WsFrame *ws_message_plain(WsMessage *msg) {
+    if (!msg->plain) {
+        msg->plain = ws_frame_new(msg->op, msg->data, msg->len);
+        msg->plain->refcount++;
+    }
+    return msg->plain;
+}
+
+static WsFrame *ws_message_frame(Manager *m, WsMessage *msg, ConnectionWrapper *cw) {
+#if CIRCLET_ENABLE_ZLIB
+    if (ws_compressible(m, cw, msg->op, msg->len)) {
+        if (!msg->deflated) {
+            size_t n = ws_deflate(m, msg->data, msg->len);
+            msg->deflated = n ? ws_frame_new(msg->op | CIRCLET_WS_DEFLATED, m->ws_deflated.data, n)
+                : ws_message_plain(msg);
+            msg->deflated->refcount++;
+        }
+        return msg->deflated;
+    }
+#else
+    (void) m;
+    (void) cw;
+#endif
+    return ws_message_plain(msg);
+}
+
+static void ws_message_deinit(WsMessage *msg) {
+    if (msg->plain) ws_frame_release(msg->plain);
+    if (msg->deflated) ws_frame_release(msg->deflated);
+}
+
+/* Bytes waiting to go out on a connection */
+static size_t connection_buffered(struct mg_connection *c) {
+    ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+    size_t n = c->send_mbuf.len;
+    if (cw && cw->conn == c) n += cw->ws_queue.bytes;
+    return n;
+}
+
+/* Write queued frames straight from the shared buffers, several to a writev
+ * where there is one. Only runs once
+ * send_mbuf is empty, so frames never overtake what is already there. When
+ * the socket fills up, the rest of the current frame is copied to send_mbuf,
+ * which keeps the stream whole and gets mongoose to wait for writability. */
+static void ws_flush(struct mg_connection *c) {
+    ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+    if (!cw || cw->conn != c) return;
+    WsQueue *q = &cw->ws_queue;
+    if (c->flags & MG_F_SEND_AND_CLOSE) {
+        /* A close frame has been sent, nothing may follow it */
+        ws_queue_clear(q);
+        return;
+    }
+    if (c->flags & MG_F_SSL) {
+        /* The TLS layer has to see every byte, so there is no sharing */
+        for (; q->count; ws_queue_pop(q)) mg_send(c, q->frames[q->head]->data, q->frames[q->head]->len);
+        return;
+    }
+    while (q->count && !c->send_mbuf.len &&
+           !(c->flags & (MG_F_CLOSE_IMMEDIATELY | MG_F_CONNECTING))) {
+#ifndef _WIN32
+        /* Hand the socket as many frames as one writev takes */
+        struct iovec iov[CIRCLET_WS_IOV];
+        int count = 0;
+        for (; (size_t) count < q->count && count < CIRCLET_WS_IOV; count++) {
+            WsFrame *f = q->frames[(q->head + count) % q->capacity];
+            iov[count].iov_base = f->data;
+            iov[count].iov_len = f->len;
+        }
+        ssize_t n = writev(c->sock, iov, count);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                c->flags |= MG_F_CLOSE_IMMEDIATELY;
+                return;
+            }
+            n = 0;
+        }
+        if (n > 0) c->last_io_time = (time_t) mg_time();
+        size_t sent = (size_t) n;
+        for (; count && sent >= q->frames[q->head]->len; count--) {
+            sent -= q->frames[q->head]->len;
+            ws_queue_pop(q);
+        }
+        if (!count) continue;
+        WsFrame *f = q->frames[q->head];
+#else
+        WsFrame *f = q->frames[q->head];
+        int n = c->iface->vtable->tcp_send(c, f->data, f->len);
+        if (n < 0) {
+            c->flags |= MG_F_CLOSE_IMMEDIATELY;
+            return;
+        }
+        if (n > 0) c->last_io_time = (time_t) mg_time();
+        size_t sent = (size_t) n;
+#endif
+        if (sent < f->len) mg_send(c, f->data + sent, f->len - sent);
+        ws_queue_pop(q);
+    }
+}
+
+static int is_websocket(const struct mg_connection *nc) {
+    return nc->flags & MG_F_IS_WEBSOCKET;
+}
+
+/* Put a connection with coalesced frames on the pending list of its manager */
+static void ws_pending_add(Manager *m, ConnectionWrapper *cw) {
+    if (cw->ws_pending) return;
+    cw->ws_pending = 1;
+    cw->ws_pending_prev = NULL;
+    cw->ws_pending_next = m->ws_pending;
+    if (m->ws_pending) m->ws_pending->ws_pending_prev = cw;
+    m->ws_pending = cw;
+}
+
+static void ws_pending_remove(Manager *m, ConnectionWrapper *cw) {
+    if (!cw->ws_pending) return;
+    cw->ws_pending = 0;
+    if (cw->ws_pending_prev) cw->ws_pending_prev->ws_pending_next = cw->ws_pending_next;
+    else m->ws_pending = cw->ws_pending_next;
+    if (cw->ws_pending_next) cw->ws_pending_next->ws_pending_prev = cw->ws_pending_prev;
+    cw->ws_pending_prev = cw->ws_pending_next = NULL;
+}
+
+/* Write what was queued on the websocket connections of a manager while
+ * writes are coalesced. Only connections on the pending list are visited,
+ * and each gets its frames in as few writev calls as they fit in. A
+ * connection stays on the list while part of its queue has to wait for the
+ * socket to drain send_mbuf. */
+static void ws_flush_all(Manager *m) {
+    ConnectionWrapper *cw = m->ws_pending;
+    while (cw) {
+        ConnectionWrapper *next = cw->ws_pending_next;
+        struct mg_connection *c = cw->conn;
+        if (c && m->ws_separator && !(c->flags & MG_F_SEND_AND_CLOSE))
+            ws_queue_merge(&cw->ws_queue, m->ws_separator, m->ws_separator_len);
+        if (c) ws_flush(c);
+        if (!c || !cw->ws_queue.count) ws_pending_remove(m, cw);
+        cw = next;
     }
-    janet_table_put(payload, janet_ckeywordv("headers"), janet_wrap_table(headers));
-    return janet_wrap_table(payload);
 }
 
-/* Send an HTTP reply. This should try not to panic, as at this point we
- * are outside of the janet interpreter. Instead, send a 500 response with
- * some formatted error message. */
-static void send_http(struct mg_connection *c, Janet res, void *ev_data) {
-    switch (janet_type(res)) {
-        default:
-            mg_send_head(c, 500, 0, "");
-            break;
-        case JANET_TABLE:
-        case JANET_STRUCT:
-            {
-                const JanetKV *kvs;
-                int32_t kvlen, kvcap;
-                janet_dictionary_view(res, &kvs, &kvlen, &kvcap);
+/* Whether frames can still be sent on a connection */
+static int ws_open(struct mg_connection *c) {
+    ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+    return is_websocket(c) && cw && cw->conn == c &&
+        !(c->flags & (MG_F_SEND_AND_CLOSE | MG_F_CLOSE_IMMEDIATELY));
+}
 
-                /* Get response kind and check for special handling methods. */
-                Janet kind = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("kind"));
-                if (janet_checktype(kind, JANET_KEYWORD)) {
-                    const uint8_t *kindstr = janet_unwrap_keyword(kind);
+/* Whether a frame of a websocket connection holds a whole data message,
+ * which can be dropped without breaking the stream */
+static int ws_droppable(int op) {
+    return !(op & WEBSOCKET_DONT_FIN) && (op & 0x0f) != WEBSOCKET_OP_CONTINUE && !(op & 0x08);
+}
 
-                    /* Check for serving static files */
-                    if (!janet_cstrcmp(kindstr, "static")) {
-                        /* Construct static serve options */
-                        struct mg_serve_http_opts opts;
-                        memset(&opts, 0, sizeof(opts));
-                        Janet root = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("root"));
-                        opts.document_root = getstring(root, NULL);
-                        mg_serve_http(c, (struct http_message *) ev_data, opts);
-                        return;
-                    }
+static int ws_frame_op(const WsFrame *f) {
+    return (f->data[0] & 0x80 ? 0 : WEBSOCKET_DONT_FIN) | (f->data[0] & 0x0f);
+}
 
-                    /* Check for serving single file */
-                    if (!janet_cstrcmp(kindstr, "file")) {
-                        Janet filev = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("file"));
-                        Janet mimev = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("mime"));
-                        const char *mime = getstring(mimev, "text/plain");
-                        const char *filepath;
-                        if (!janet_checktype(filev, JANET_STRING)) {
-                            mg_send_head(c, 500, 0, "expected string :file option to serve a file");
-                            break;
-                        }
-                        filepath = getstring(filev, "");
-                        mg_http_serve_file(c, (struct http_message *)ev_data, filepath, mg_mk_str(mime), mg_mk_str(""));
-                        return;
-                    }
-                }
+/* Whether len more bytes would take a websocket connection over the queue
+ * limits of its manager */
+static int ws_queue_full(struct mg_connection *c, size_t len) {
+    Manager *m = (Manager *) c->mgr;
+    ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+    return (m->ws_queue_bytes && connection_buffered(c) + len > m->ws_queue_bytes) ||
+        (m->ws_queue_messages && cw->ws_queue.count >= m->ws_queue_messages);
+}
 
-                /* Serve a generic HTTP response */
+/* Make room for a frame of len bytes on a websocket connection whose queue
+ * is full, by the policy of its manager. Fragments and control frames are
+ * never dropped, a connection that cannot take them is evicted instead.
+ * Returns 0 if the frame is not to be sent. */
+static int ws_admit(struct mg_connection *c, int op, size_t len) {
+    if (!ws_queue_full(c, len)) return 1;
+    Manager *m = (Manager *) c->mgr;
+    ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+    WsQueue *q = &cw->ws_queue;
+    if (m->ws_queue_policy == CIRCLET_WS_QUEUE_DROP_OLDEST) {
+        while (q->count && ws_droppable(ws_frame_op(q->frames[q->head])) && ws_queue_full(c, len)) {
+            ws_queue_pop(q);
+            cw->ws_dropped++;
+            m->ws_dropped++;
+        }
+        if (!ws_queue_full(c, len)) return 1;
+    }
+    if (m->ws_queue_policy != CIRCLET_WS_QUEUE_CLOSE && ws_droppable(op)) {
+        cw->ws_dropped++;
+        m->ws_dropped++;
+        return 0;
+    }
+    /* 1008, policy violation. A peer that has not taken what is already in
+     * send_mbuf would never get to the close frame behind it, so it is
+     * dropped at once; otherwise it has a little while to read the close. */
+    ws_queue_clear(q);
+    if (c->send_mbuf.len) {
+        c->flags |= MG_F_CLOSE_IMMEDIATELY;
+    } else {
+        mg_send_websocket_frame(c, WEBSOCKET_OP_CLOSE, "\x03\xf0", 2);
+        mg_set_timer(c, mg_time() + CIRCLET_WS_CLOSE_GRACE);
+    }
+    m->ws_evicted++;
+    return 0;
+}
 
-                Janet status = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("status"));
-                Janet headers = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("headers"));
-                Janet body = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("body"));
+/* Queue a shared frame on an open websocket connection and, unless writes
+ * are coalesced, write what the socket takes right away. Returns 0 if the
+ * queue had no room for it. */
+static int ws_send_frame(struct mg_connection *c, WsFrame *f) {
+    ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+    if (!ws_admit(c, ws_frame_op(f), f->len)) return 0;
+    ws_queue_push(&cw->ws_queue, f);
+    /* Coalesced frames wait for the manager to flush them */
+    if (((Manager *) c->mgr)->ws_coalesce) ws_pending_add((Manager *) c->mgr, cw);
+    else ws_flush(c);
+    return 1;
+}
 
-                int code;
-                if (janet_checktype(status, JANET_NIL))
-                    code = 200;
-                else if (janet_checkint(status))
-                    code = janet_unwrap_integer(status);
-                else
-                    break;
+/* Send a message to an open websocket connection in the form it takes */
+static int ws_send_message(struct mg_connection *c, WsMessage *msg) {
+    return ws_send_frame(c, ws_message_frame((Manager *) c->mgr, msg, (ConnectionWrapper *) c->user_data));
+}
 
-                const JanetKV *headerkvs;
-                int32_t headerlen, headercap;
-                if (janet_checktype(headers, JANET_NIL)) {
-                    headerkvs = NULL;
-                    headerlen = 0;
-                    headercap = 0;
-                } else if (!janet_dictionary_view(headers, &headerkvs, &headerlen, &headercap)) {
-                    break;
-                }
+/* Websocket connections grouped by topic. A connection may be in any number
+ * of topics, so each membership is on the member list of its topic and on
+ * the topic list of its connection. */
+typedef struct WsTopic {
+    MapNode node;
+    struct WsMember *members;
+} WsTopic;
 
-                const uint8_t *bodybytes;
-                int32_t bodylen;
-                if (janet_checktype(body, JANET_NIL)) {
-                    bodybytes = NULL;
-                    bodylen = 0;
-                } else if (!janet_bytes_view(body, &bodybytes, &bodylen)) {
-                    break;
-                }
+typedef struct WsMember {
+    WsTopic *topic;
+    struct mg_connection *conn;
+    struct WsMember *prev, *next;
+    struct WsMember *next_topic;
+} WsMember;
 
-                mg_send_response_line(c, code, NULL);
-                for (const JanetKV *kv = janet_dictionary_next(headerkvs, headercap, NULL);
-                        kv;
-                        kv = janet_dictionary_next(headerkvs, headercap, kv)) {
-                    const uint8_t *name = janet_to_string(kv->key);
-                    int32_t header_len;
-                    const Janet *header_items;
-                    if (janet_indexed_view(kv->value, &header_items, &header_len)) {
-                        /* Array-like of headers */
-                        for (int32_t i = 0; i < header_len; i++) {
-                            const uint8_t *value = janet_to_string(header_items[i]);
-                            mg_printf(c, "%s: %s\r\n", (const char *)name, (const char *)value);
-                        }
-                    } else {
-                        /* Single header */
-                        const uint8_t *value = janet_to_string(kv->value);
-                        mg_printf(c, "%s: %s\r\n", (const char *)name, (const char *)value);
-                    }
-                }
+static int ws_subscribe(struct mg_connection *c, const uint8_t *name, int32_t len) {
+    Manager *m = (Manager *) c->mgr;
+    ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+    WsTopic *topic = (WsTopic *) map_find(&m->ws_topics, (const char *) name, len);
+    for (WsMember *mem = cw->topics; mem && topic; mem = mem->next_topic)
+        if (mem->topic == topic) return 0;
+    WsMember *mem = calloc(1, sizeof(WsMember));
+    if (!mem) JANET_OUT_OF_MEMORY;
+    if (!topic) {
+        topic = calloc(1, sizeof(WsTopic));
+        if (!topic || !(topic->node.key = malloc(len ? len : 1))) JANET_OUT_OF_MEMORY;
+        memcpy(topic->node.key, name, len);
+        topic->node.keylen = len;
+        map_insert(&m->ws_topics, &topic->node);
+    }
+    mem->topic = topic;
+    mem->conn = c;
+    mem->next = topic->members;
+    if (mem->next) mem->next->prev = mem;
+    topic->members = mem;
+    mem->next_topic = cw->topics;
+    cw->topics = mem;
+    return 1;
+}
 
-                mg_printf(c, "Content-Length: %d\r\n", bodylen);
-                mg_printf(c, "\r\n");
-                if (bodylen) mg_send(c, bodybytes, bodylen);
+/* Leave the named topic, or every topic when name is NULL */
+static int ws_unsubscribe(struct mg_connection *c, const uint8_t *name, int32_t len) {
+    Manager *m = (Manager *) c->mgr;
+    ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+    WsMember **at = &cw->topics;
+    int count = 0;
+    while (*at) {
+        WsMember *mem = *at;
+        WsTopic *topic = mem->topic;
+        if (name && (topic->node.keylen != (size_t) len || memcmp(topic->node.key, name, len))) {
+            at = &mem->next_topic;
+            continue;
+        }
+        *at = mem->next_topic;
+        if (mem->prev) mem->prev->next = mem->next;
+        else topic->members = mem->next;
+        if (mem->next) mem->next->prev = mem->prev;
+        if (!topic->members) {
+            map_remove(&m->ws_topics, &topic->node);
+            free(topic->node.key);
+            free(topic);
+        }
+        free(mem);
+        count++;
+    }
+    return count;
+}
+
+/* Send a frame to one connection. When nothing else is waiting, header and
+ * payload go to the socket in one writev straight from the caller's memory,
+ * and only what the socket does not take is copied. Otherwise the frame is
+ * queued behind the others. Messages to a permessage-deflate connection are
+ * compressed first. */
+static int ws_send(struct mg_connection *c, int op, const uint8_t *payload, size_t len) {
+    ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+    if (!ws_open(c)) return 0;
+#if CIRCLET_ENABLE_ZLIB
+    Manager *m = (Manager *) c->mgr;
+    if (ws_compressible(m, cw, op, len)) {
+        size_t n = ws_deflate(m, payload, len);
+        if (n) {
+            payload = m->ws_deflated.data;
+            len = n;
+            op |= CIRCLET_WS_DEFLATED;
+        }
+    }
+#endif
+#ifndef _WIN32
+    if (!cw->ws_queue.count && !c->send_mbuf.len && !(c->flags & MG_F_SSL) &&
+            !((Manager *) c->mgr)->ws_coalesce) {
+        unsigned char header[10];
+        size_t header_len = ws_header(header, op, len);
+        if (!ws_admit(c, op, header_len + len)) return 0;
+        struct iovec iov[2] = {{header, header_len}, {(void *) payload, len}};
+        ssize_t n = writev(c->sock, iov, 2);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                c->flags |= MG_F_CLOSE_IMMEDIATELY;
+                return 0;
             }
-            break;
+            n = 0;
+        }
+        if (n > 0) c->last_io_time = (time_t) mg_time();
+        if ((size_t) n < header_len) mg_send(c, header + n, (int) (header_len - n));
+        size_t sent = (size_t) n > header_len ? (size_t) n - header_len : 0;
+        if (sent < len) mg_send(c, payload + sent, (int) (len - sent));
+        return 1;
+    }
+#endif
+    WsFrame *f = ws_frame_new(op, payload, len);
+    f->refcount++;
+    int sent = ws_send_frame(c, f);
+    ws_frame_release(f);
+    return sent;
+}
+
+/* Give an accepted connection its own wrapper, so that Janet code can tell
+ * connections apart */
+static void connection_accept(struct mg_connection *c) {
+    ConnectionWrapper *listener = (ConnectionWrapper *) c->user_data;
+    ConnectionWrapper *cw = janet_abstract(&Connection_jt, sizeof(ConnectionWrapper));
+    cw->conn = c;
+    cw->fiber = listener->fiber;
+    cw->on_writable = NULL;
+    cw->nodelay = listener->nodelay;
+    cw->cork = listener->cork;
+    memset(&cw->ws_queue, 0, sizeof(cw->ws_queue));
+    cw->topics = NULL;
+    cw->ws_flags = 0;
+    cw->ws_stream = listener->ws_stream;
+    cw->ws_max_message = listener->ws_max_message;
+    cw->ws_message = 0;
+    cw->ws_message_size = 0;
+    cw->ws_dropped = 0;
+    cw->ws_ping_interval = listener->ws_ping_interval;
+    cw->ws_pong_timeout = listener->ws_pong_timeout;
+    cw->ws_last_seen = 0;
+    cw->ws_ping_sent = 0;
+    cw->ws_handler = listener->ws_handler;
+    cw->ws_fiber = NULL;
+    cw->ws_state = janet_wrap_nil();
+    cw->ws_pending = 0;
+    cw->ws_pending_prev = cw->ws_pending_next = NULL;
+#if CIRCLET_ENABLE_ZLIB
+    cw->ws_inflater = NULL;
+#endif
+    c->user_data = cw;
+    if (cw->nodelay) {
+        int on = 1;
+        setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, (const char *) &on, sizeof(on));
+    }
+    if (cw->ws_stream) c->flags |= MG_F_WEBSOCKET_NO_DEFRAG;
+}
+
+/* Hold back partial segments while a response is being written, so that
+ * its head and body leave in full packets. The cork is pulled once the
+ * send buffer is empty. */
+static void connection_cork(struct mg_connection *c, int on) {
+#ifdef CIRCLET_TCP_CORK
+    ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+    if (!cw || !cw->cork || !(c->flags & CIRCLET_F_CORKED) == !on) return;
+    if (on && !c->send_mbuf.len) return;
+    if (on) c->flags |= CIRCLET_F_CORKED;
+    else c->flags &= ~CIRCLET_F_CORKED;
+    setsockopt(c->sock, IPPROTO_TCP, CIRCLET_TCP_CORK, (const char *) &on, sizeof(on));
+#else
+    (void) c;
+    (void) on;
+#endif
+}
+
+/* Call the writable callback of a connection once its send buffer is down
+ * to the low water mark */
+static void connection_writable(struct mg_connection *c) {
+    ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+    if (!cw || !cw->on_writable || connection_buffered(c) > ((Manager *) c->mgr)->send_low_water) return;
+    JanetFunction *callback = cw->on_writable;
+    cw->on_writable = NULL;
+    Janet arg = janet_wrap_abstract(cw), out;
+    JanetFiber *fiber = NULL;
+    if (janet_pcall(callback, 1, &arg, &out, &fiber) != JANET_SIGNAL_OK)
+        janet_stacktrace(fiber, out);
+}
+
+static void connection_close(struct mg_connection *c) {
+    ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+    stream_free(c);
+    sse_unsubscribe(c);
+    if (cw && cw->conn == c) {
+        ws_unsubscribe(c, NULL, 0);
+        ws_pending_remove((Manager *) c->mgr, cw);
+        ws_queue_clear(&cw->ws_queue);
+#if CIRCLET_ENABLE_ZLIB
+        if (cw->ws_inflater) {
+            inflateEnd(cw->ws_inflater);
+            free(cw->ws_inflater);
+            cw->ws_inflater = NULL;
+        }
+#endif
+        cw->conn = NULL;
+        cw->on_writable = NULL;
+        cw->ws_fiber = NULL;
+        cw->ws_state = janet_wrap_nil();
     }
-    mg_printf(c, "\r\n");
-    c->flags |= MG_F_SEND_AND_CLOSE;
 }
 
 /* The dispatching event handler. This handler is what
@@ -231,7 +3069,24 @@ static void http_handler(struct mg_connection *c, int ev, void *p) {
     switch (ev) {
         default:
             return;
+        case MG_EV_ACCEPT:
+            connection_accept(c);
+            return;
+        case MG_EV_SEND:
+            if (!((Manager *) c->mgr)->ws_coalesce) ws_flush(c);
+            stream_pump(c);
+            connection_writable(c);
+            if (!c->send_mbuf.len) connection_cork(c, 0);
+            return;
+        case MG_EV_POLL:
+            if (!((Manager *) c->mgr)->ws_coalesce) ws_flush(c);
+            connection_writable(c);
+            return;
+        case MG_EV_CLOSE:
+            connection_close(c);
+            return;
         case MG_EV_HTTP_REQUEST:
+            if (validator_check(c, (struct http_message *)p)) return;
             evdata = build_http_request(c, (struct http_message *)p);
             break;
     }
@@ -246,20 +3101,206 @@ static void http_handler(struct mg_connection *c, int ev, void *p) {
         return;
     }
     send_http(c, out, p);
+    connection_cork(c, 1);
+}
+
+static Janet cfun_poll(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    Manager *m = janet_getabstract(argv, 0, &Manager_jt);
+    int32_t wait = janet_getinteger(argv, 1);
+    m->generation++;
+    /* Frames coalesced since the last poll go out before it blocks, so that
+     * select watches for the rest of them and nothing waits out the timeout */
+    if (m->ws_pending) ws_flush_all(m);
+    mg_mgr_poll(&m->mgr, wait);
+    if (m->ws_pending) ws_flush_all(m);
+    return argv[0];
 }
 
 static Janet cfun_manager(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 0);
-    (void) argv;
-    void *mgr = janet_abstract(&Manager_jt, sizeof(struct mg_mgr));
-    mg_mgr_init(mgr, NULL);
-    return janet_wrap_abstract(mgr);
+    janet_arity(argc, 0, 1);
+    Janet opts = argc > 0 ? argv[0] : janet_wrap_nil();
+    size_t cache_size = option_size(opts, "file-cache-size", 0);
+    size_t cache_max_entry = option_size(opts, "file-cache-max-entry", 1024 * 1024);
+    double cache_ttl = option_number(opts, "file-cache-ttl", 1.0);
+    Janet index_roots = option(opts, "static-index");
+    int index_watch = option_boolean(opts, "static-index-watch", 1);
+    int precompressed = option_boolean(opts, "precompressed", 1);
+    int compress = option_boolean(opts, "compress", 0);
+    double compress_level = option_number(opts, "compress-level", 6);
+    size_t compress_min_size = option_size(opts, "compress-min-size", 1024);
+    size_t compress_cache_size = option_size(opts, "compress-cache-size", 0);
+    double etag_cache_ttl = option_number(opts, "etag-cache-ttl", 0);
+    double file_threads = option_number(opts, "file-threads", 0);
+    size_t send_high_water = option_size(opts, "send-high-water", 1024 * 1024);
+    size_t send_low_water = option_size(opts, "send-low-water", 16 * 1024);
+    int accept_budget = option_int(opts, "accept-budget", 16);
+    int accept_cap = option_int(opts, "accept-cap", 64);
+    int eager_send = option_boolean(opts, "eager-send", 1);
+    int ws_deflate = option_boolean(opts, "ws-deflate", 0);
+    int ws_no_context_takeover = option_boolean(opts, "ws-no-context-takeover", 0);
+    size_t ws_deflate_min_size = option_size(opts, "ws-deflate-min-size", 64);
+    size_t ws_queue_bytes = option_size(opts, "ws-queue-bytes", 0);
+    size_t ws_queue_messages = option_size(opts, "ws-queue-messages", 0);
+    int ws_coalesce = option_boolean(opts, "ws-coalesce", 0);
+    Janet separator = option(opts, "ws-batch-separator");
+    if (!janet_checktype(separator, JANET_NIL) && !janet_checktype(separator, JANET_STRING))
+        janet_panicf("expected string for option :ws-batch-separator, got %v", separator);
+    Janet policy = option(opts, "ws-queue-policy");
+    int ws_queue_policy = CIRCLET_WS_QUEUE_CLOSE;
+    if (!janet_checktype(policy, JANET_NIL)) {
+        const uint8_t *name = janet_checktype(policy, JANET_KEYWORD) ? janet_unwrap_keyword(policy) : NULL;
+        if (name && !janet_cstrcmp(name, "drop-oldest"))
+            ws_queue_policy = CIRCLET_WS_QUEUE_DROP_OLDEST;
+        else if (name && !janet_cstrcmp(name, "drop-newest"))
+            ws_queue_policy = CIRCLET_WS_QUEUE_DROP_NEWEST;
+        else if (!name || janet_cstrcmp(name, "close"))
+            janet_panicf("expected :close, :drop-oldest or :drop-newest for option :ws-queue-policy, got %v", policy);
+    }
+    if (send_low_water > send_high_water)
+        janet_panic("option :send-low-water must not be above :send-high-water");
+    if (file_threads != (int) file_threads || file_threads < 0 || file_threads > 256)
+        janet_panicf("expected integer from 0 to 256 for option :file-threads, got %v",
+                     janet_wrap_number(file_threads));
+#if !MG_ENABLE_FILE_THREADS
+    if (file_threads > 0) janet_panic("option :file-threads is not supported on this platform");
+#endif
+    if (compress_level != (int) compress_level || compress_level < 1 || compress_level > 9)
+        janet_panicf("expected integer from 1 to 9 for option :compress-level, got %v",
+                     janet_wrap_number(compress_level));
+#if !CIRCLET_ENABLE_ZLIB
+    if (compress) janet_panic("option :compress is not supported in this build");
+    if (ws_deflate) janet_panic("option :ws-deflate is not supported in this build");
+#endif
+    const Janet *roots = NULL;
+    int32_t nroots = 0;
+    if (janet_checktype(index_roots, JANET_STRING)) {
+        roots = &index_roots;
+        nroots = 1;
+    } else if (!janet_checktype(index_roots, JANET_NIL) &&
+            !janet_indexed_view(index_roots, &roots, &nroots)) {
+        janet_panicf("expected string or array of strings for option :static-index, got %v", index_roots);
+    }
+    for (int32_t i = 0; i < nroots; i++) {
+        if (!janet_checktype(roots[i], JANET_STRING))
+            janet_panicf("expected string static root, got %v", roots[i]);
+    }
+#ifdef _WIN32
+    if (nroots) janet_panic("option :static-index is not supported on this platform");
+#endif
+    Manager *m = janet_abstract(&Manager_jt, sizeof(Manager));
+    memset(m, 0, sizeof(Manager));
+    mg_mgr_init(&m->mgr, NULL);
+    cache_init(&m->file_cache, cache_size, cache_max_entry, cache_ttl, 1);
+    cache_init(&m->compress_cache, compress_cache_size, compress_cache_size, 0, 0);
+    m->precompressed = precompressed;
+    m->compress = compress;
+    m->compress_level = compress_level;
+    m->compress_min_size = compress_min_size;
+    m->validator_ttl = etag_cache_ttl;
+    m->send_high_water = send_high_water;
+    m->send_low_water = send_low_water;
+    m->mgr.accept_budget = accept_budget;
+    m->mgr.accept_cap = accept_cap;
+    m->mgr.eager_send = eager_send;
+    m->ws_deflate = ws_deflate;
+    m->ws_no_context_takeover = ws_no_context_takeover;
+    m->ws_deflate_min_size = ws_deflate_min_size;
+    m->ws_queue_bytes = ws_queue_bytes;
+    m->ws_queue_messages = ws_queue_messages;
+    m->ws_queue_policy = ws_queue_policy;
+    /* Batching into one frame happens as coalesced frames are written */
+    m->ws_coalesce = ws_coalesce || janet_checktype(separator, JANET_STRING);
+    if (janet_checktype(separator, JANET_STRING)) {
+        const uint8_t *sep = janet_unwrap_string(separator);
+        m->ws_separator_len = janet_string_length(sep);
+        m->ws_separator = malloc(m->ws_separator_len + 1);
+        if (!m->ws_separator) JANET_OUT_OF_MEMORY;
+        memcpy(m->ws_separator, sep, m->ws_separator_len);
+    }
+#if MG_ENABLE_FILE_THREADS
+    if (file_threads > 0 && !mg_mgr_set_file_threads(&m->mgr, (int) file_threads))
+        janet_panic("could not start file threads");
+#endif
+#ifndef _WIN32
+    for (int32_t i = 0; i < nroots; i++)
+        index_add_root(m, (const char *) janet_unwrap_string(roots[i]), index_watch);
+#else
+    (void) index_watch;
+#endif
+    return janet_wrap_abstract(m);
+}
+
+#ifndef _WIN32
+/* Listen on a unix domain socket. A socket file left behind by a server
+ * that is gone is removed first, but not one that is still accepting. */
+static struct mg_connection *bind_unix(struct mg_mgr *mgr, const char *path,
+        void (*handler)(struct mg_connection *, int, void *), int mode,
+        const char **err) {
+    struct sockaddr_un sun;
+    struct stat st;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        *err = "socket path too long";
+        return NULL;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        sock_t probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probe != INVALID_SOCKET) {
+            if (connect(probe, (struct sockaddr *) &sun, sizeof(sun)) != 0 && errno == ECONNREFUSED)
+                unlink(path);
+            closesocket(probe);
+        }
+    }
+    sock_t sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) {
+        *err = strerror(errno);
+        return NULL;
+    }
+    if (bind(sock, (struct sockaddr *) &sun, sizeof(sun)) != 0 ||
+            (mode >= 0 && chmod(path, mode) != 0) ||
+            listen(sock, SOMAXCONN) != 0) {
+        *err = strerror(errno);
+        closesocket(sock);
+        return NULL;
+    }
+    struct mg_connection *conn = mg_add_sock(mgr, sock, handler);
+    if (!conn) {
+        *err = "out of memory";
+        closesocket(sock);
+        return NULL;
+    }
+    conn->flags |= MG_F_LISTENING;
+    return conn;
 }
+#endif
 
 /* Common functionality for binding */
 static void do_bind(int32_t argc, Janet *argv, struct mg_connection **connout,
         void (*handler)(struct mg_connection *, int, void *)) {
-    janet_fixarity(argc, 3);
+    janet_arity(argc, 3, 4);
+    Janet bindopts = argc > 3 ? argv[3] : janet_wrap_nil();
+    double mode = option_number(bindopts, "socket-mode", -1);
+    if (mode != -1 && (mode != (int) mode || mode < 0 || mode > 07777))
+        janet_panicf("expected file mode for option :socket-mode, got %v", janet_wrap_number(mode));
+    int backlog = option_int(bindopts, "backlog", 0);
+    int nodelay = option_boolean(bindopts, "nodelay", 0);
+    int defer_accept = option_int(bindopts, "defer-accept", 0);
+    int fastopen = option_int(bindopts, "fastopen", 0);
+    int sndbuf = option_int(bindopts, "sndbuf", 0);
+    int rcvbuf = option_int(bindopts, "rcvbuf", 0);
+    int cork = option_boolean(bindopts, "cork", 0);
+    int ws_stream = option_boolean(bindopts, "ws-stream", 0);
+    size_t ws_max_message = option_size(bindopts, "ws-max-message", 0);
+    double ws_ping_interval = option_number(bindopts, "ws-ping-interval", 0);
+    double ws_pong_timeout = option_number(bindopts, "ws-pong-timeout", ws_ping_interval);
+    if (ws_ping_interval < 0 || ws_pong_timeout < 0)
+        janet_panic("options :ws-ping-interval and :ws-pong-timeout must not be negative");
+    Janet ws_handler = option(bindopts, "ws-handler");
+    if (!janet_checktype(ws_handler, JANET_NIL) && !janet_checktype(ws_handler, JANET_FUNCTION))
+        janet_panicf("expected function for option :ws-handler, got %v", ws_handler);
 
     /* We use opts, so that we can read the error reason from mongoose if bind fails.
     As described here https://github.com/cesanta/mongoose/issues/983 */
@@ -271,14 +3312,55 @@ static void do_bind(int32_t argc, Janet *argv, struct mg_connection **connout,
     struct mg_mgr *mgr = janet_getabstract(argv, 0, &Manager_jt);
     const uint8_t *port = janet_getstring(argv, 1);
     JanetFunction *onConnection = janet_getfunction(argv, 2);
-    struct mg_connection *conn = mg_bind_opt(mgr, (const char *)port, handler, opts);
+    struct mg_connection *conn;
+    if (!strncmp((const char *) port, "unix:", 5)) {
+#ifndef _WIN32
+        conn = bind_unix(mgr, (const char *) port + 5, handler, (int) mode, &err);
+#else
+        (void) mode;
+        janet_panic("unix domain sockets are not supported on this platform");
+#endif
+    } else {
+        conn = mg_bind_opt(mgr, (const char *)port, handler, opts);
+    }
     if (NULL == conn) {
         janet_panicf("could not bind to %s, reason being: %s", port, err);
     }
+
+    /* Socket options are set on the listener, and inherited by accepted
+     * sockets, apart from nodelay which is set on each one */
+    int tcp = strncmp((const char *) port, "unix:", 5) && !(conn->flags & MG_F_UDP);
+    if (sndbuf)
+        setsockopt(conn->sock, SOL_SOCKET, SO_SNDBUF, (const char *) &sndbuf, sizeof(sndbuf));
+    if (rcvbuf)
+        setsockopt(conn->sock, SOL_SOCKET, SO_RCVBUF, (const char *) &rcvbuf, sizeof(rcvbuf));
+#ifdef TCP_DEFER_ACCEPT
+    if (tcp && defer_accept)
+        setsockopt(conn->sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, (const char *) &defer_accept, sizeof(defer_accept));
+#else
+    (void) defer_accept;
+#endif
+#ifdef TCP_FASTOPEN
+    if (tcp && fastopen)
+        setsockopt(conn->sock, IPPROTO_TCP, TCP_FASTOPEN, (const char *) &fastopen, sizeof(fastopen));
+#else
+    (void) fastopen;
+#endif
+    /* Listening again only changes the backlog */
+    if (backlog && !(conn->flags & MG_F_UDP)) listen(conn->sock, backlog);
     JanetFiber *fiber = janet_fiber(onConnection, 64, 0, NULL);
     ConnectionWrapper *cw = janet_abstract(&Connection_jt, sizeof(ConnectionWrapper));
+    memset(cw, 0, sizeof(ConnectionWrapper));
     cw->conn = conn;
     cw->fiber = fiber;
+    cw->nodelay = tcp && nodelay;
+    cw->cork = tcp && cork;
+    cw->ws_stream = ws_stream;
+    cw->ws_max_message = ws_max_message;
+    cw->ws_ping_interval = ws_ping_interval;
+    cw->ws_pong_timeout = ws_pong_timeout;
+    if (janet_checktype(ws_handler, JANET_FUNCTION)) cw->ws_handler = janet_unwrap_function(ws_handler);
+    cw->ws_state = janet_wrap_nil();
     conn->user_data = cw;
     Janet out;
     JanetSignal status = janet_continue(fiber, janet_wrap_abstract(cw), &out);
@@ -297,15 +3379,13 @@ static Janet cfun_bind_http(int32_t argc, Janet *argv) {
 
 
 
-static int is_websocket(const struct mg_connection *nc) {
-    return nc->flags & MG_F_IS_WEBSOCKET;
-}
-
 static Janet build_websocket_event(struct mg_connection *c, Janet event, struct websocket_message *wm) {
     JanetTable *payload;
     if (wm) {
-       payload = janet_table(4);
+       payload = janet_table(6);
        janet_table_put(payload, janet_ckeywordv("data"), janet_stringv((const uint8_t *) wm->data, wm->size));
+       janet_table_put(payload, janet_ckeywordv("opcode"), ws_opcodev(wm->flags));
+       janet_table_put(payload, janet_ckeywordv("fin"), janet_wrap_boolean(wm->flags & 0x80));
     } else {
        payload = janet_table(3);
     }
@@ -316,6 +3396,108 @@ static Janet build_websocket_event(struct mg_connection *c, Janet event, struct
     return janet_wrap_table(payload);
 }
 
+/* Turn a websocket frame into an event for the handler. Streamed
+ * connections get each frame of a fragmented message as a :chunk event,
+ * with the opcode of the message and whether it is the first and the final
+ * frame. Returns 0 if the frame is dropped. */
+static int ws_receive(struct mg_connection *c, struct websocket_message *wm, Janet *evdata) {
+    ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+    /* Nothing more is taken once a close frame has gone out */
+    if (!cw || cw->conn != c || (c->flags & MG_F_SEND_AND_CLOSE)) return 0;
+    int message = wm->flags, first = 1, fin = wm->flags & 0x80;
+    size_t room = cw->ws_max_message ? cw->ws_max_message : SIZE_MAX;
+    if (c->flags & MG_F_WEBSOCKET_NO_DEFRAG) {
+        first = (wm->flags & 0x0f) != WEBSOCKET_OP_CONTINUE;
+        if (first == !!cw->ws_message) {
+            /* 1002, protocol error: a continuation outside of a message,
+             * or a new message before the last one ended */
+            mg_send_websocket_frame(c, WEBSOCKET_OP_CLOSE, "\x03\xea", 2);
+            return 0;
+        }
+        if (!first) {
+            message = cw->ws_message;
+            room -= cw->ws_message_size;
+        }
+    }
+#if CIRCLET_ENABLE_ZLIB
+    struct websocket_message inflated;
+    if ((message & CIRCLET_WS_DEFLATED) && !(wm = ws_inflate_message(c, wm, first, room, &inflated)))
+        return 0;
+#endif
+    if (wm->size > room) {
+        ws_close_too_big(c);
+        return 0;
+    }
+    if (c->flags & MG_F_WEBSOCKET_NO_DEFRAG) {
+        cw->ws_message = fin ? 0 : message;
+        cw->ws_message_size = fin ? 0 : cw->ws_message_size + wm->size;
+    }
+    if (first && fin) {
+        *evdata = build_websocket_event(c, janet_ckeywordv("message"), wm);
+        return 1;
+    }
+    *evdata = build_websocket_event(c, janet_ckeywordv("chunk"), wm);
+    JanetTable *payload = janet_unwrap_table(*evdata);
+    janet_table_put(payload, janet_ckeywordv("opcode"), ws_opcodev(message));
+    janet_table_put(payload, janet_ckeywordv("first"), janet_wrap_boolean(first));
+    return 1;
+}
+
+/* Keep a websocket connection alive, or find out that it is not, on the
+ * timer of the connection. A ping goes out once the peer has been quiet
+ * for the ping interval, and a peer that sends nothing back within the
+ * pong timeout is dropped without a closing handshake. */
+static void ws_keepalive(struct mg_connection *c, double now) {
+    ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+    if (!cw || cw->conn != c || cw->ws_ping_interval <= 0) return;
+    if (cw->ws_ping_sent > 0 && cw->ws_last_seen < cw->ws_ping_sent) {
+        if (now < cw->ws_ping_sent + cw->ws_pong_timeout) {
+            mg_set_timer(c, cw->ws_ping_sent + cw->ws_pong_timeout);
+            return;
+        }
+        ((Manager *) c->mgr)->ws_timed_out++;
+        c->flags |= MG_F_CLOSE_IMMEDIATELY;
+        return;
+    }
+    cw->ws_ping_sent = 0;
+    if (now < cw->ws_last_seen + cw->ws_ping_interval) {
+        mg_set_timer(c, cw->ws_last_seen + cw->ws_ping_interval);
+        return;
+    }
+    mg_send_websocket_frame(c, WEBSOCKET_OP_PING, "", 0);
+    cw->ws_ping_sent = now;
+    mg_set_timer(c, now + cw->ws_pong_timeout);
+}
+
+/* Pass an event to the fiber of its websocket connection, which is started
+ * on the :open event with the :ws-handler of the listener. Each value the
+ * fiber yields suspends it until the next event of its connection. Once the
+ * handler returns or fails, the connection is closed, and the fiber is let
+ * go of after the :close event. */
+static void ws_dispatch(struct mg_connection *c, int ev, Janet evdata) {
+    ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+    if (ev == MG_EV_WEBSOCKET_HANDSHAKE_DONE) {
+        cw->ws_fiber = janet_fiber(cw->ws_handler, 64, 1, &evdata);
+        evdata = janet_wrap_nil();
+        if (!cw->ws_fiber) {
+            /* 1011, internal error: the handler does not take one argument */
+            mg_send_websocket_frame(c, WEBSOCKET_OP_CLOSE, "\x03\xf3", 2);
+            return;
+        }
+    }
+    JanetFiber *fiber = cw->ws_fiber;
+    if (!fiber) return;
+    Janet out;
+    JanetSignal status = janet_continue(fiber, evdata, &out);
+    if (status == JANET_SIGNAL_YIELD && ev != MG_EV_CLOSE) return;
+    if (status != JANET_SIGNAL_OK && status != JANET_SIGNAL_YIELD) {
+        janet_stacktrace(fiber, out);
+    }
+    cw->ws_fiber = NULL;
+    /* 1000, normal closure: the handler is done with the connection */
+    if (ev != MG_EV_CLOSE && ws_open(c)) mg_send_websocket_frame(c, WEBSOCKET_OP_CLOSE, "\x03\xe8", 2);
+}
+
 /* The dispatching event handler. This handler is what
  * is presented to mongoose, but it dispatches to dynamically
  * defined handlers. */
@@ -326,19 +3508,48 @@ static void http_websocket_handler(struct mg_connection *c, int ev, void *p) {
         default:
             return;
 
-        case MG_EV_HTTP_REQUEST: {
+        case MG_EV_HTTP_REQUEST:
+        case MG_EV_ACCEPT:
+        case MG_EV_SEND:
+        case MG_EV_POLL: {
             http_handler(c, ev, p);
             return;
         }
 
         case MG_EV_WEBSOCKET_HANDSHAKE_DONE: {
+            ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+            if (cw->ws_ping_interval > 0) {
+                cw->ws_last_seen = mg_time();
+                mg_set_timer(c, cw->ws_last_seen + cw->ws_ping_interval);
+            }
             evdata = build_websocket_event(c, janet_ckeywordv("open"), NULL);
             break;
         }
 
+#if CIRCLET_ENABLE_ZLIB
+        case MG_EV_WEBSOCKET_HANDSHAKE_REQUEST: {
+            ws_handshake(c, (struct http_message *) p);
+            return;
+        }
+#endif
+
+        case MG_EV_RECV: {
+            if (!is_websocket(c)) return;
+            ConnectionWrapper *cw = (ConnectionWrapper *) c->user_data;
+            if (cw && cw->conn == c) cw->ws_last_seen = mg_time();
+            ws_check_size(c);
+            return;
+        }
+
+        case MG_EV_TIMER: {
+            /* A close frame still not written when its deadline is up */
+            if (c->flags & MG_F_SEND_AND_CLOSE) c->flags |= MG_F_CLOSE_IMMEDIATELY;
+            else if (is_websocket(c)) ws_keepalive(c, mg_time());
+            return;
+        }
+
         case MG_EV_WEBSOCKET_FRAME: {
-            struct websocket_message *wm = (struct websocket_message *) p;
-            evdata = build_websocket_event(c, janet_ckeywordv("message"), wm);
+            if (!ws_receive(c, (struct websocket_message *) p, &evdata)) return;
             break;
         }
 
@@ -352,13 +3563,17 @@ static void http_websocket_handler(struct mg_connection *c, int ev, void *p) {
     ConnectionWrapper *cw;
     JanetFiber *fiber;
     cw = (ConnectionWrapper *)(c->user_data);
-    fiber = cw->fiber;
-    Janet out;
-    JanetSignal status = janet_continue(fiber, evdata, &out);
-    if (status != JANET_SIGNAL_OK && status != JANET_SIGNAL_YIELD) {
-        janet_stacktrace(fiber, out);
-        return;
+    if (cw->ws_handler && is_websocket(c)) {
+        ws_dispatch(c, ev, evdata);
+    } else {
+        fiber = cw->fiber;
+        Janet out;
+        JanetSignal status = janet_continue(fiber, evdata, &out);
+        if (status != JANET_SIGNAL_OK && status != JANET_SIGNAL_YIELD) {
+            janet_stacktrace(fiber, out);
+        }
     }
+    if (ev == MG_EV_CLOSE) connection_close(c);
 }
 
 static Janet cfun_bind_http_websocket(int32_t argc, Janet *argv) {
@@ -368,15 +3583,206 @@ static Janet cfun_bind_http_websocket(int32_t argc, Janet *argv) {
     return argv[0];
 }
 
+/* Read an optional opcode keyword at argv[n] and an optional fin flag after
+ * it, and check them against the payload length. Close frames are left to
+ * mongoose, which closes the connection once they are sent. */
+static int ws_getopcode(int32_t argc, Janet *argv, int32_t n, size_t len) {
+    int op = WEBSOCKET_OP_TEXT;
+    if (argc > n && !janet_checktype(argv[n], JANET_NIL)) {
+        const uint8_t *kind = janet_getkeyword(argv, n);
+        for (op = 0; op < 16; op++)
+            if (op != WEBSOCKET_OP_CLOSE && ws_opcodes[op] && !janet_cstrcmp(kind, ws_opcodes[op])) break;
+        if (op == 16) janet_panicf("unknown websocket opcode %v", argv[n]);
+    }
+    if (argc > n + 1 && !janet_truthy(argv[n + 1])) {
+        if (op & 0x08) janet_panic("control frames cannot be fragmented");
+        op |= WEBSOCKET_DONT_FIN;
+    }
+    if ((op & 0x08) && len > 125) janet_panic("control frame payload is longer than 125 bytes");
+    return op;
+}
+
+/* A message from data at argv[n] and an optional opcode after it */
+static void ws_message_arg(WsMessage *msg, int32_t argc, Janet *argv, int32_t n) {
+    JanetByteView data = janet_getbytes(argv, n);
+    msg->op = ws_getopcode(argc, argv, n + 1, (size_t) data.len);
+    msg->data = data.bytes;
+    msg->len = (size_t) data.len;
+    msg->plain = msg->deflated = NULL;
+}
+
 static Janet cfun_broadcast(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 3);
     struct mg_mgr *mgr = janet_getabstract(argv, 0, &Manager_jt);
-    const char *buf = janet_getcstring(argv, 1);
+
+    /* Encode the frame once, every websocket connection shares it */
+    WsMessage msg;
+    ws_message_arg(&msg, argc, argv, 1);
     struct mg_connection *c;
     for (c = mg_next(mgr, NULL); c != NULL; c = mg_next(mgr, c)) {
-      mg_send_websocket_frame(c, WEBSOCKET_OP_TEXT, buf, strlen(buf));
+        if (ws_open(c)) ws_send_message(c, &msg);
+    }
+    ws_message_deinit(&msg);
+
+    return argv[0];
+}
+
+static Janet cfun_ws_send(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 4);
+    ConnectionWrapper *cw = janet_getabstract(argv, 0, &Connection_jt);
+    JanetByteView data = janet_getbytes(argv, 1);
+    int op = ws_getopcode(argc, argv, 2, (size_t) data.len);
+    if (!cw->conn) return janet_wrap_false();
+    return janet_wrap_boolean(ws_send(cw->conn, op, data.bytes, (size_t) data.len));
+}
+
+static Janet cfun_subscribe(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    ConnectionWrapper *cw = janet_getabstract(argv, 0, &Connection_jt);
+    JanetByteView topic = janet_getbytes(argv, 1);
+    if (!cw->conn) return janet_wrap_false();
+    return janet_wrap_boolean(ws_subscribe(cw->conn, topic.bytes, topic.len));
+}
+
+static Janet cfun_unsubscribe(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    ConnectionWrapper *cw = janet_getabstract(argv, 0, &Connection_jt);
+    if (!cw->conn) return janet_wrap_integer(0);
+    if (argc < 2) return janet_wrap_integer(ws_unsubscribe(cw->conn, NULL, 0));
+    JanetByteView topic = janet_getbytes(argv, 1);
+    return janet_wrap_integer(ws_unsubscribe(cw->conn, topic.bytes, topic.len));
+}
+
+static Janet cfun_publish(int32_t argc, Janet *argv) {
+    janet_arity(argc, 3, 4);
+    Manager *m = janet_getabstract(argv, 0, &Manager_jt);
+    JanetByteView name = janet_getbytes(argv, 1);
+    int32_t count = 0;
+    WsTopic *topic = (WsTopic *) map_find(&m->ws_topics, (const char *) name.bytes, name.len);
+    if (!topic) return janet_wrap_integer(0);
+    WsMessage msg;
+    ws_message_arg(&msg, argc, argv, 2);
+    for (WsMember *mem = topic->members; mem; mem = mem->next) {
+        if (ws_open(mem->conn) && ws_send_message(mem->conn, &msg)) count++;
+    }
+    ws_message_deinit(&msg);
+    return janet_wrap_integer(count);
+}
+
+/* Counters of the websocket send queues of a manager, or of one connection */
+static Janet cfun_ws_stats(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    JanetTable *stats = janet_table(3);
+    Manager *m = janet_checkabstract(argv[0], &Manager_jt);
+    if (m) {
+        janet_table_put(stats, janet_ckeywordv("dropped"), janet_wrap_number((double) m->ws_dropped));
+        janet_table_put(stats, janet_ckeywordv("evicted"), janet_wrap_number((double) m->ws_evicted));
+        janet_table_put(stats, janet_ckeywordv("timed-out"), janet_wrap_number((double) m->ws_timed_out));
+        return janet_wrap_table(stats);
+    }
+    ConnectionWrapper *cw = janet_getabstract(argv, 0, &Connection_jt);
+    janet_table_put(stats, janet_ckeywordv("dropped"), janet_wrap_number((double) cw->ws_dropped));
+    janet_table_put(stats, janet_ckeywordv("queued"),
+                    janet_wrap_number(cw->conn ? (double) cw->ws_queue.count : 0));
+    janet_table_put(stats, janet_ckeywordv("buffered"),
+                    janet_wrap_number(cw->conn ? (double) connection_buffered(cw->conn) : 0));
+    return janet_wrap_table(stats);
+}
+
+/* Append one field of a Server-Sent Event. Each line of a multi-line value
+ * becomes a field of its own. */
+static void sse_push_field(JanetBuffer *buf, const char *field, const uint8_t *value,
+        int32_t len, int multiline) {
+    int32_t start = 0;
+    for (int32_t i = 0; i <= len; i++) {
+        if (i < len && value[i] != '\n' && value[i] != '\r') continue;
+        if (i < len && !multiline) janet_panicf("expected single line for event %s", field);
+        janet_buffer_push_cstring(buf, field);
+        janet_buffer_push_bytes(buf, (const uint8_t *) ": ", 2);
+        janet_buffer_push_bytes(buf, value + start, i - start);
+        janet_buffer_push_u8(buf, '\n');
+        if (i + 1 < len && value[i] == '\r' && value[i + 1] == '\n') i++;
+        start = i + 1;
+    }
+}
+
+static Janet cfun_sse_send(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 3);
+    Manager *m = janet_getabstract(argv, 0, &Manager_jt);
+    JanetByteView name = janet_getbytes(argv, 1);
+    Janet event = argv[2];
+
+    /* Format the event once, it is the same for every subscriber */
+    JanetBuffer *buf = janet_buffer(64);
+    const JanetKV *kvs;
+    int32_t kvlen, kvcap;
+    if (janet_checktype(event, JANET_NIL)) {
+        /* A comment, to keep idle connections from timing out */
+        janet_buffer_push_bytes(buf, (const uint8_t *) ":\n\n", 3);
+    } else if (janet_dictionary_view(event, &kvs, &kvlen, &kvcap)) {
+        static const char *const fields[] = {"id", "event", "retry", "data"};
+        for (int i = 0; i < 4; i++) {
+            Janet value = janet_dictionary_get(kvs, kvcap, janet_ckeywordv(fields[i]));
+            if (janet_checktype(value, JANET_NIL)) continue;
+            const uint8_t *str = janet_to_string(value);
+            sse_push_field(buf, fields[i], str, janet_string_length(str), i == 3);
+        }
+        janet_buffer_push_u8(buf, '\n');
+    } else {
+        const uint8_t *str = janet_to_string(event);
+        sse_push_field(buf, "data", str, janet_string_length(str), 1);
+        janet_buffer_push_u8(buf, '\n');
+    }
+
+    int32_t count = 0;
+    SseChannel *ch = (SseChannel *) map_find(&m->sse_channels, (const char *) name.bytes, name.len);
+    for (SseSubscriber *sub = ch ? ch->subscribers : NULL; sub; sub = sub->next) {
+        /* A client this far behind is dropped, it can reconnect and
+         * catch up from its Last-Event-ID */
+        if (sub->conn->send_mbuf.len > m->send_high_water) {
+            sub->conn->flags |= MG_F_CLOSE_IMMEDIATELY;
+            continue;
+        }
+        mg_send(sub->conn, buf->data, buf->count);
+        count++;
     }
+    return janet_wrap_integer(count);
+}
+
+static Janet cfun_state(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    ConnectionWrapper *cw = janet_getabstract(argv, 0, &Connection_jt);
+    return cw->ws_state;
+}
 
+static Janet cfun_set_state(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    ConnectionWrapper *cw = janet_getabstract(argv, 0, &Connection_jt);
+    /* Nothing is kept for a closed connection */
+    if (cw->conn) cw->ws_state = argv[1];
+    return argv[1];
+}
+
+static Janet cfun_send_buffered(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    ConnectionWrapper *cw = janet_getabstract(argv, 0, &Connection_jt);
+    if (!cw->conn) return janet_wrap_nil();
+    return janet_wrap_number((double) connection_buffered(cw->conn));
+}
+
+static Janet cfun_writable(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    ConnectionWrapper *cw = janet_getabstract(argv, 0, &Connection_jt);
+    struct mg_connection *c = cw->conn;
+    return janet_wrap_boolean(c && !(c->flags & (MG_F_SEND_AND_CLOSE | MG_F_CLOSE_IMMEDIATELY)) &&
+                              connection_buffered(c) < ((Manager *) c->mgr)->send_high_water);
+}
+
+static Janet cfun_on_writable(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    ConnectionWrapper *cw = janet_getabstract(argv, 0, &Connection_jt);
+    JanetFunction *callback = janet_getfunction(argv, 1);
+    if (cw->conn) cw->on_writable = callback;
     return argv[0];
 }
 
@@ -385,6 +3791,17 @@ static const JanetReg cfuns[] = {
     {"poll", cfun_poll, NULL},
     {"bind-http", cfun_bind_http, NULL},
     {"broadcast", cfun_broadcast, NULL},
+    {"ws-send", cfun_ws_send, NULL},
+    {"subscribe", cfun_subscribe, NULL},
+    {"unsubscribe", cfun_unsubscribe, NULL},
+    {"publish", cfun_publish, NULL},
+    {"ws-stats", cfun_ws_stats, NULL},
+    {"sse-send", cfun_sse_send, NULL},
+    {"state", cfun_state, NULL},
+    {"set-state", cfun_set_state, NULL},
+    {"send-buffered", cfun_send_buffered, NULL},
+    {"writable?", cfun_writable, NULL},
+    {"on-writable", cfun_on_writable, NULL},
     {"bind-http-websocket", cfun_bind_http_websocket, NULL},
     {NULL, NULL, NULL}
 };
@@ -126,8 +126,10 @@ MG_INTERNAL int mg_uri_to_local_path(struct http_message *hm,
                                      const struct mg_serve_http_opts *opts,
                                      char **local_path,
                                      struct mg_str *remainder);
-MG_INTERNAL time_t mg_parse_date_string(const char *datetime);
-MG_INTERNAL int mg_is_not_modified(struct http_message *hm, cs_stat_t *st);
+#endif
+#if MG_ENABLE_FILE_THREADS
+MG_INTERNAL void mg_file_pool_complete(struct mg_mgr *mgr);
+MG_INTERNAL void mg_file_pool_free(struct mg_mgr *mgr);
 #endif
 #if MG_ENABLE_HTTP_CGI
 MG_INTERNAL void mg_handle_cgi(struct mg_connection *nc, const char *prog,
@@ -2474,6 +2476,9 @@ void mg_mgr_free(struct mg_mgr *m) {
   if (m == NULL) return;
   /* Do one last poll, see https://github.com/cesanta/mongoose/issues/286 */
   mg_mgr_poll(m, 0);
+#if MG_ENABLE_FILE_THREADS
+  mg_file_pool_free(m);
+#endif
 
 #if MG_ENABLE_BROADCAST
   if (m->ctl[0] != INVALID_SOCKET) closesocket(m->ctl[0]);
@@ -2502,9 +2507,13 @@ void mg_mgr_free(struct mg_mgr *m) {
 int mg_mgr_poll(struct mg_mgr *m, int timeout_ms) {
   int i, num_calls_before = m->num_calls;
 
+  m->num_accepted = 0;
   for (i = 0; i < m->num_ifaces; i++) {
     m->ifaces[i]->vtable->poll(m->ifaces[i], timeout_ms);
   }
+#if MG_ENABLE_FILE_THREADS
+  mg_file_pool_complete(m);
+#endif
 
   return (m->num_calls - num_calls_before);
 }
@@ -3787,7 +3796,13 @@ static int mg_accept_conn(struct mg_connection *lc) {
   union socket_address sa;
   socklen_t sa_len = sizeof(sa);
   /* NOTE(lsm): on Windows, sock is always > FD_SETSIZE */
+#if defined(__linux__) && defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+  /* Get the socket nonblocking and close-on-exec without further calls */
+  sock_t sock =
+      accept4(lc->sock, &sa.sa, &sa_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
   sock_t sock = accept(lc->sock, &sa.sa, &sa_len);
+#endif
   if (sock == INVALID_SOCKET) {
     if (mg_is_error()) {
       DBG(("%p: failed to accept: %d", lc, mg_get_errno()));
@@ -3801,11 +3816,30 @@ static int mg_accept_conn(struct mg_connection *lc) {
   }
   DBG(("%p conn from %s:%d", nc, inet_ntoa(sa.sin.sin_addr),
        ntohs(sa.sin.sin_port)));
+#if defined(__linux__) && defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+  nc->sock = sock;
+#else
   mg_sock_set(nc, sock);
+#endif
   mg_if_accept_tcp_cb(nc, &sa, sa_len);
   return 1;
 }
 
+/*
+ * Accept up to mgr->accept_budget pending connections, but no more than
+ * what is left of mgr->accept_cap for this poll. Whatever stays queued
+ * keeps the listener readable for the next poll.
+ */
+static void mg_accept_conns(struct mg_connection *lc) {
+  struct mg_mgr *mgr = lc->mgr;
+  int budget = mgr->accept_budget > 0 ? mgr->accept_budget : 1;
+  while (budget-- > 0 &&
+         (mgr->accept_cap <= 0 || mgr->num_accepted < mgr->accept_cap) &&
+         !(lc->flags & MG_F_CLOSE_IMMEDIATELY) && mg_accept_conn(lc)) {
+    mgr->num_accepted++;
+  }
+}
+
 /* 'sa' must be an initialized address to bind to */
 static sock_t mg_open_listening_socket(union socket_address *sa, int type,
                                        int proto) {
@@ -3900,18 +3934,28 @@ void mg_mgr_handle_conn(struct mg_connection *nc, int fd_flags, double now) {
     } else {
       if (nc->flags & MG_F_LISTENING) {
         /*
-         * We're not looping here, and accepting just one connection at
-         * a time. The reason is that eCos does not respect non-blocking
-         * flag on a listening socket and hangs in a loop.
+         * By default we're not looping here, and accepting just one
+         * connection at a time. The reason is that eCos does not respect
+         * non-blocking flag on a listening socket and hangs in a loop.
          */
-        mg_accept_conn(nc);
+        mg_accept_conns(nc);
       } else {
         mg_if_can_recv_cb(nc);
       }
     }
   }
 
-  if (fd_flags & _MG_F_FD_CAN_WRITE) mg_if_can_send_cb(nc);
+  if (fd_flags & _MG_F_FD_CAN_WRITE) {
+    mg_if_can_send_cb(nc);
+  } else if ((fd_flags & _MG_F_FD_CAN_READ) && nc->mgr->eager_send &&
+             nc->send_mbuf.len > 0) {
+    /*
+     * The read handler has just queued a reply. Rather than waiting for the
+     * next poll iteration to report the socket writable, try to write it now;
+     * whatever does not fit stays in send_mbuf for the regular path.
+     */
+    mg_if_can_send_cb(nc);
+  }
 
   if (worth_logging) {
     DBG(("%p after fd=%d nc_flags=0x%lx rmbl=%d smbl=%d", nc, (int) nc->sock,
@@ -5740,14 +5784,72 @@ static const char *mg_version_header = "Mongoose/" MG_VERSION;
 
 enum mg_http_proto_data_type { DATA_NONE, DATA_FILE, DATA_PUT };
 
+struct mg_http_file_range {
+  int64_t start; /* Offset of the range in the file. */
+  int64_t len;   /* Length of the range. */
+  char *head;    /* Multipart header sent before the range, or NULL. */
+};
+
 struct mg_http_proto_data_file {
   FILE *fp;      /* Opened file. */
   int64_t cl;    /* Content-Length. How many bytes to send. */
   int64_t sent;  /* How many bytes have been already sent. */
   int keepalive; /* Keep connection open after sending. */
   enum mg_http_proto_data_type type;
+  struct mg_http_file_range *ranges; /* File parts to send, for DATA_FILE. */
+  int nranges;                       /* Number of parts. */
+  int range;                         /* Part being sent. */
+  int64_t range_sent;                /* Bytes of that part already sent. */
+#if MG_ENABLE_FILE_THREADS
+  struct mg_file_job *job; /* Open or read in progress on a file thread. */
+#endif
+};
+
+#if MG_ENABLE_FILE_THREADS
+enum mg_file_job_kind { MG_FILE_JOB_OPEN, MG_FILE_JOB_READ };
+
+/*
+ * A file operation done on a file thread. Jobs are only created, finished
+ * and abandoned on the manager's thread.
+ */
+struct mg_file_job {
+  struct mg_file_job *next;
+  struct mg_connection *nc; /* NULL once the response has been abandoned. */
+  enum mg_file_job_kind kind;
+  FILE *fp; /* Opened file, or the file to read from. */
+  int err;  /* errno of a failed open. */
+  /* MG_FILE_JOB_OPEN: the request is kept to build the response later. */
+  char *path;
+  cs_stat_t st;
+  struct mg_str message, mime_type, encoding, extra_headers;
+  /* MG_FILE_JOB_READ */
+  int64_t offset;
+  size_t len; /* Bytes to read into buf. */
+  size_t n;   /* Bytes read, 0 on error. */
+  char *buf;
 };
 
+struct mg_file_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct mg_file_job *queue, **queue_tail; /* Waiting for a thread. */
+  struct mg_file_job *done, **done_tail;   /* Waiting for mg_mgr_poll(). */
+  pthread_t *threads;
+  int num_threads;
+  int alive; /* Threads that have not exited yet. */
+  int stop;
+  struct mg_mgr *mgr;
+};
+
+MG_INTERNAL int mg_file_pool_open(struct mg_connection *nc,
+                                  struct http_message *hm, const char *path,
+                                  struct mg_str mime_type,
+                                  struct mg_str encoding,
+                                  struct mg_str extra_headers);
+MG_INTERNAL int mg_file_pool_read(struct mg_connection *nc, int64_t offset,
+                                  int64_t left);
+#endif
+
 #if MG_ENABLE_HTTP_CGI
 struct mg_http_proto_data_cgi {
   struct mg_connection *cgi_nc;
@@ -5866,9 +5968,21 @@ static void mg_http_free_proto_data_mp_stream(
 #if MG_ENABLE_FILESYSTEM
 static void mg_http_free_proto_data_file(struct mg_http_proto_data_file *d) {
   if (d != NULL) {
+    int i;
+#if MG_ENABLE_FILE_THREADS
+    if (d->job != NULL) {
+      /* The job still runs, and closes the file when it completes. */
+      d->job->nc = NULL;
+      if (d->job->kind == MG_FILE_JOB_READ) d->fp = NULL;
+    }
+#endif
     if (d->fp != NULL) {
       fclose(d->fp);
     }
+    for (i = 0; i < d->nranges; i++) {
+      MG_FREE(d->ranges[i].head);
+    }
+    MG_FREE(d->ranges);
     memset(d, 0, sizeof(struct mg_http_proto_data_file));
   }
 }
@@ -5995,7 +6109,7 @@ static struct mg_str mg_get_mime_types_entry(struct mg_str path) {
   return mg_mk_str(NULL);
 }
 
-MG_INTERNAL int mg_get_mime_type_encoding(
+int mg_get_mime_type_encoding(
     struct mg_str path, struct mg_str *type, struct mg_str *encoding,
     const struct mg_serve_http_opts *opts) {
   const char *ext, *overrides;
@@ -6170,32 +6284,108 @@ struct mg_str *mg_get_http_header(struct http_message *hm, const char *name) {
 }
 
 #if MG_ENABLE_FILESYSTEM
+#if MG_ENABLE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+static void mg_http_file_seek(FILE *fp, int64_t off) {
+#if _FILE_OFFSET_BITS == 64 || _POSIX_C_SOURCE >= 200112L || \
+    _XOPEN_SOURCE >= 600
+  fseeko(fp, off, SEEK_SET);
+#else
+  fseek(fp, (long) off, SEEK_SET);
+#endif
+}
+
+/*
+ * Moves on to the next part of a file response, queueing its multipart
+ * header if it has one.
+ */
+static void mg_http_next_file_range(struct mg_connection *nc,
+                                    struct mg_http_proto_data_file *d) {
+  d->range++;
+  d->range_sent = 0;
+  if (d->range < d->nranges && d->ranges[d->range].head != NULL) {
+    size_t len = strlen(d->ranges[d->range].head);
+    mg_send(nc, d->ranges[d->range].head, (int) len);
+    d->sent += len;
+  }
+}
+
 static void mg_http_transfer_file_data(struct mg_connection *nc) {
   struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
   char buf[MG_MAX_HTTP_SEND_MBUF];
-  size_t n = 0, to_read = 0, left = (size_t)(pd->file.cl - pd->file.sent);
+  size_t n = 0, left = (size_t)(pd->file.cl - pd->file.sent);
 
   if (pd->file.type == DATA_FILE) {
     struct mbuf *io = &nc->send_mbuf;
-    if (io->len >= MG_MAX_HTTP_SEND_MBUF) {
-      to_read = 0;
-    } else {
-      to_read = MG_MAX_HTTP_SEND_MBUF - io->len;
-    }
-    if (to_read > left) {
-      to_read = left;
-    }
-    if (to_read > 0) {
-      n = mg_fread(buf, 1, to_read, pd->file.fp);
-      if (n > 0) {
-        mg_send(nc, buf, n);
-        pd->file.sent += n;
-        DBG(("%p sent %d (total %d)", nc, (int) n, (int) pd->file.sent));
+    struct mg_http_proto_data_file *d = &pd->file;
+    size_t limit = MG_MAX_HTTP_SEND_MBUF;
+    int failed = 0;
+#if MG_ENABLE_FILE_THREADS
+    /* A read on a file thread calls us again when it completes */
+    if (d->job != NULL) return;
+    if (nc->mgr->file_pool != NULL) limit = MG_FILE_READ_SIZE;
+#endif
+    while (d->range < d->nranges && io->len < limit) {
+      struct mg_http_file_range *r = &d->ranges[d->range];
+      int64_t range_left = r->len - d->range_sent;
+      size_t to_read =
+          MG_MAX_HTTP_SEND_MBUF - MIN(io->len, MG_MAX_HTTP_SEND_MBUF);
+      if (range_left <= 0) {
+        mg_http_next_file_range(nc, d);
+        continue;
       }
-    } else {
-      /* Rate-limited */
+#if MG_ENABLE_FILE_THREADS
+      if (nc->mgr->file_pool != NULL &&
+          mg_file_pool_read(nc, r->start + d->range_sent, range_left)) {
+        return;
+      }
+#endif
+#if MG_ENABLE_SENDFILE
+      /*
+       * Flush what is queued and write straight from the file. Whatever is
+       * left afterwards goes through the send buffer, so that the connection
+       * is polled for writing and we get called again.
+       */
+      if (io->len > 0 && !(nc->flags & MG_F_SSL)) {
+        int sn = nc->iface->vtable->tcp_send(nc, io->buf, io->len);
+        if (sn > 0) {
+          mbuf_remove(io, sn);
+          nc->last_io_time = (time_t) mg_time();
+        }
+      }
+      if (io->len == 0 && !(nc->flags & MG_F_SSL)) {
+        off_t off = (off_t)(r->start + d->range_sent);
+        size_t chunk = range_left > (1 << 20) ? (1 << 20) : (size_t) range_left;
+        ssize_t sn = sendfile(nc->sock, fileno(d->fp), &off, chunk);
+        if (sn > 0) {
+          d->range_sent += sn;
+          d->sent += sn;
+          nc->last_io_time = (time_t) mg_time();
+          range_left -= sn;
+          if (range_left <= 0) continue;
+        }
+      }
+#endif
+      if ((int64_t) to_read > range_left) to_read = (size_t) range_left;
+      mg_http_file_seek(d->fp, r->start + d->range_sent);
+      n = mg_fread(buf, 1, to_read, d->fp);
+      if (n == 0) {
+        /* The file has shrunk under us, the response cannot be completed */
+        failed = 1;
+        break;
+      }
+      mg_send(nc, buf, n);
+      d->range_sent += n;
+      d->sent += n;
+      DBG(("%p sent %d (total %d)", nc, (int) n, (int) d->sent));
     }
-    if (pd->file.sent >= pd->file.cl) {
+    if (failed) {
+      nc->flags |= MG_F_SEND_AND_CLOSE;
+      mg_http_free_proto_data_file(&pd->file);
+      pd->finished = 1;
+    } else if (d->range >= d->nranges) {
       LOG(LL_DEBUG, ("%p done, %d bytes, ka %d", nc, (int) pd->file.sent,
                      pd->file.keepalive));
       if (!pd->file.keepalive) nc->flags |= MG_F_SEND_AND_CLOSE;
@@ -6935,6 +7125,8 @@ const char *mg_status_message(int status_code) {
       return "Moved";
     case 302:
       return "Found";
+    case 304:
+      return "Not Modified";
     case 400:
       return "Bad Request";
     case 401:
@@ -6983,8 +7175,6 @@ const char *mg_status_message(int status_code) {
       return "Multiple Choices";
     case 303:
       return "See Other";
-    case 304:
-      return "Not Modified";
     case 305:
       return "Use Proxy";
     case 306:
@@ -7119,10 +7309,9 @@ void mg_http_send_error(struct mg_connection *nc, int code,
 }
 
 #if MG_ENABLE_FILESYSTEM
-static void mg_http_construct_etag(char *buf, size_t buf_len,
-                                   const cs_stat_t *st) {
-  snprintf(buf, buf_len, "\"%lx.%" INT64_FMT "\"", (unsigned long) st->st_mtime,
-           (int64_t) st->st_size);
+void mg_http_construct_etag(char *buf, size_t buf_len, const cs_stat_t *st) {
+  snprintf(buf, buf_len, "\"%lx.%lx.%" INT64_FMT "\"", (unsigned long) st->st_ino,
+           (unsigned long) st->st_mtime, (int64_t) st->st_size);
 }
 
 #ifndef WINCE
@@ -7134,6 +7323,8 @@ static void mg_gmt_time_string(char *buf, size_t buf_len, time_t *t) {
 static void mg_gmt_time_string(char *buf, size_t buf_len, time_t *t);
 #endif
 
+#if MG_ENABLE_HTTP_WEBDAV
+/* Used by mg_handle_put only; GET ranges go through mg_http_parse_ranges */
 static int mg_http_parse_range_header(const struct mg_str *header, int64_t *a,
                                       int64_t *b) {
   /*
@@ -7149,6 +7340,268 @@ static int mg_http_parse_range_header(const struct mg_str *header, int64_t *a,
   MG_FREE(p);
   return result;
 }
+#endif /* MG_ENABLE_HTTP_WEBDAV */
+
+/*
+ * Parses a Range header into at most MG_MAX_HTTP_RANGES ranges of a file of
+ * the given size, sorted and with overlapping ranges merged. Returns the
+ * number of ranges, 0 if the header should be ignored, or -1 if none of the
+ * ranges can be satisfied.
+ */
+static int mg_http_parse_ranges(const struct mg_str *header, int64_t size,
+                                struct mg_http_file_range *ranges) {
+  const char *p = header->p, *end = header->p + header->len;
+  int n = 0, i, j, unsatisfiable = 0;
+  while (p < end && *p == ' ') p++;
+  if (end - p < 6 || mg_ncasecmp(p, "bytes=", 6) != 0) return 0;
+  p += 6;
+  while (p < end) {
+    int64_t a = -1, b = -1;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+    if (p >= end) break;
+    if (isdigit(*(const unsigned char *) p)) {
+      for (a = 0; p < end && isdigit(*(const unsigned char *) p); p++) {
+        if (a > (INT64_MAX - 9) / 10) return 0;
+        a = a * 10 + (*p - '0');
+      }
+    }
+    if (p >= end || *p != '-') return 0;
+    p++;
+    if (p < end && isdigit(*(const unsigned char *) p)) {
+      for (b = 0; p < end && isdigit(*(const unsigned char *) p); p++) {
+        if (b > (INT64_MAX - 9) / 10) return 0;
+        b = b * 10 + (*p - '0');
+      }
+    }
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (p < end && *p != ',') return 0;
+    if (a < 0) {
+      /* Suffix range: the last b bytes */
+      if (b < 0) return 0;
+      if (b == 0 || size == 0) {
+        unsatisfiable = 1;
+        continue;
+      }
+      a = b > size ? 0 : size - b;
+      b = size - 1;
+    } else {
+      if (b >= 0 && b < a) return 0;
+      if (a >= size) {
+        unsatisfiable = 1;
+        continue;
+      }
+      if (b < 0 || b >= size) b = size - 1;
+    }
+    if (n == MG_MAX_HTTP_RANGES) return 0;
+    ranges[n].start = a;
+    ranges[n].len = b - a + 1;
+    ranges[n].head = NULL;
+    n++;
+  }
+  if (n == 0) return unsatisfiable ? -1 : 0;
+  /* Sort by offset and coalesce, so parts never overlap */
+  for (i = 1; i < n; i++) {
+    struct mg_http_file_range r = ranges[i];
+    for (j = i; j > 0 && ranges[j - 1].start > r.start; j--) {
+      ranges[j] = ranges[j - 1];
+    }
+    ranges[j] = r;
+  }
+  for (i = 0, j = 1; j < n; j++) {
+    int64_t i_end = ranges[i].start + ranges[i].len;
+    if (ranges[j].start <= i_end) {
+      int64_t j_end = ranges[j].start + ranges[j].len;
+      if (j_end > i_end) ranges[i].len = j_end - ranges[i].start;
+    } else {
+      ranges[++i] = ranges[j];
+    }
+  }
+  return i + 1;
+}
+
+/*
+ * Whether an If-Range header allows a partial response: it must carry the
+ * current strong entity tag, or exactly the last modification date.
+ */
+static int mg_http_if_range_matches(const struct mg_str *hdr,
+                                    const char *etag, time_t mtime) {
+  char date[64];
+  if (hdr->len > 0 && hdr->p[0] == '"') return mg_vcmp(hdr, etag) == 0;
+  if (hdr->len > 1 && hdr->p[0] == 'W' && hdr->p[1] == '/') return 0;
+  if (hdr->len >= sizeof(date)) return 0;
+  memcpy(date, hdr->p, hdr->len);
+  date[hdr->len] = '\0';
+  return mg_parse_date_string(date) == mtime;
+}
+
+static void mg_http_send_open_error(struct mg_connection *nc, int err) {
+  int code;
+  switch (err) {
+    case EACCES:
+      code = 403;
+      break;
+    case ENOENT:
+      code = 404;
+      break;
+    default:
+      code = 500;
+  };
+  mg_http_send_error(nc, code, "Open failed");
+}
+
+/* Keeps multipart/byteranges boundaries made in the same second apart */
+static unsigned long s_boundary_seq;
+
+/*
+ * Sends the response for a file that has already been opened, taking
+ * ownership of fp.
+ */
+static void mg_http_serve_opened_file(struct mg_connection *nc,
+                                      struct http_message *hm, FILE *fp,
+                                      cs_stat_t *stp, struct mg_str mime_type,
+                                      struct mg_str encoding,
+                                      struct mg_str extra_headers) {
+  struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
+  cs_stat_t st = *stp;
+  char etag[64], current_time[50], last_modified[50], range[120];
+  char boundary[40];
+  const char *type_suffix = "";
+  time_t t = (time_t) mg_time();
+  int64_t cl = st.st_size;
+  struct mg_str *range_hdr = mg_get_http_header(hm, "Range");
+  struct mg_str *if_range_hdr = mg_get_http_header(hm, "If-Range");
+  struct mg_http_file_range ranges[MG_MAX_HTTP_RANGES + 1];
+  int i, n = 0, status_code = 200;
+
+  pd->file.fp = fp;
+  mg_set_close_on_exec((sock_t) fileno(fp));
+  if (mg_is_not_modified(hm, &st)) {
+    mg_http_free_proto_data_file(&pd->file);
+    mg_send_head(nc, 304, 0, extra_headers.p);
+    return;
+  }
+
+  mg_http_construct_etag(etag, sizeof(etag), &st);
+
+  /* Handle Range header, unless If-Range says the client's copy is stale */
+  range[0] = '\0';
+  if (range_hdr != NULL &&
+      (if_range_hdr == NULL ||
+       mg_http_if_range_matches(if_range_hdr, etag, st.st_mtime))) {
+    n = mg_http_parse_ranges(range_hdr, st.st_size, ranges);
+  }
+  if (n < 0) {
+    status_code = 416;
+    cl = 0;
+    n = 0;
+    snprintf(range, sizeof(range),
+             "Content-Range: bytes */%" INT64_FMT "\r\n",
+             (int64_t) st.st_size);
+  } else if (n == 1) {
+    status_code = 206;
+    cl = ranges[0].len;
+    snprintf(range, sizeof(range),
+             "Content-Range: bytes %" INT64_FMT "-%" INT64_FMT
+             "/%" INT64_FMT "\r\n",
+             ranges[0].start, ranges[0].start + cl - 1, (int64_t) st.st_size);
+  } else if (n > 1) {
+    /* A multipart/byteranges body, with a header before each part */
+    status_code = 206;
+    cl = 0;
+    /* Nothing about the server, such as an address, goes into it */
+    snprintf(boundary, sizeof(boundary), "%08lx%08lx%08lx", (unsigned long) t,
+             (unsigned long) ++s_boundary_seq, (unsigned long) rand());
+    for (i = 0; i < n; i++) {
+      mg_asprintf(&ranges[i].head, 0,
+                  "\r\n--%s\r\nContent-Type: %.*s\r\n"
+                  "Content-Range: bytes %" INT64_FMT "-%" INT64_FMT
+                  "/%" INT64_FMT "\r\n\r\n",
+                  boundary, (int) mime_type.len, mime_type.p,
+                  ranges[i].start, ranges[i].start + ranges[i].len - 1,
+                  (int64_t) st.st_size);
+    }
+    ranges[n].start = ranges[n].len = 0;
+    mg_asprintf(&ranges[n].head, 0, "\r\n--%s--\r\n", boundary);
+    n++;
+    for (i = 0; i < n; i++) {
+      if (ranges[i].head == NULL) {
+        for (i = 0; i < n; i++) MG_FREE(ranges[i].head);
+        mg_http_free_proto_data_file(&pd->file);
+        mg_http_send_error(nc, 500, "Out of memory");
+        return;
+      }
+      cl += (int64_t) strlen(ranges[i].head) + ranges[i].len;
+    }
+    mime_type = mg_mk_str("multipart/byteranges; boundary=");
+    type_suffix = boundary;
+  } else {
+    ranges[0].start = 0;
+    ranges[0].len = cl;
+    ranges[0].head = NULL;
+    n = 1;
+  }
+
+#if !MG_DISABLE_HTTP_KEEP_ALIVE
+  {
+    struct mg_str *conn_hdr = mg_get_http_header(hm, "Connection");
+    if (conn_hdr != NULL) {
+      pd->file.keepalive = (mg_vcasecmp(conn_hdr, "keep-alive") == 0);
+    } else {
+      pd->file.keepalive = (mg_vcmp(&hm->proto, "HTTP/1.1") == 0);
+    }
+  }
+#endif
+
+  /* A HEAD response has the same headers, but no body */
+  if (mg_vcmp(&hm->method, "HEAD") == 0) {
+    for (i = 0; i < n; i++) MG_FREE(ranges[i].head);
+    n = 0;
+  }
+  if (n > 0) {
+    pd->file.ranges = (struct mg_http_file_range *) MG_MALLOC(n * sizeof(ranges[0]));
+    if (pd->file.ranges == NULL) {
+      for (i = 0; i < n; i++) MG_FREE(ranges[i].head);
+      mg_http_free_proto_data_file(&pd->file);
+      mg_http_send_error(nc, 500, "Out of memory");
+      return;
+    }
+    memcpy(pd->file.ranges, ranges, n * sizeof(ranges[0]));
+  }
+  pd->file.nranges = n;
+  pd->file.range = 0;
+  pd->file.range_sent = 0;
+
+  mg_gmt_time_string(current_time, sizeof(current_time), &t);
+  mg_gmt_time_string(last_modified, sizeof(last_modified), &st.st_mtime);
+  mg_send_response_line_s(nc, status_code, extra_headers);
+  mg_printf(nc,
+            "Date: %s\r\n"
+            "Last-Modified: %s\r\n"
+            "Accept-Ranges: bytes\r\n"
+            "Content-Type: %.*s%s\r\n"
+            "Connection: %s\r\n"
+            "Content-Length: %" INT64_FMT
+            "\r\n"
+            "%s"
+            "Etag: %s\r\n",
+            current_time, last_modified, (int) mime_type.len, mime_type.p,
+            type_suffix, (pd->file.keepalive ? "keep-alive" : "close"), cl,
+            range, etag);
+  if (encoding.len > 0) {
+    mg_printf(nc, "Content-Encoding: %.*s\r\n", (int) encoding.len,
+              encoding.p);
+  }
+  mg_send(nc, "\r\n", 2);
+  pd->file.cl = cl;
+  pd->file.sent = 0;
+  pd->file.type = DATA_FILE;
+  if (n > 0 && pd->file.ranges[0].head != NULL) {
+    size_t len = strlen(pd->file.ranges[0].head);
+    mg_send(nc, pd->file.ranges[0].head, (int) len);
+    pd->file.sent = len;
+  }
+  mg_http_transfer_file_data(nc);
+}
 
 void mg_http_serve_file_internal(struct mg_connection *nc,
                                  struct http_message *hm, const char *path,
@@ -7157,98 +7610,282 @@ void mg_http_serve_file_internal(struct mg_connection *nc,
                                  struct mg_str extra_headers) {
   struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
   cs_stat_t st;
+  FILE *fp;
   LOG(LL_DEBUG, ("%p [%s] %.*s %.*s", nc, path, (int) mime_type.len,
                  mime_type.p, (int) encoding.len, encoding.p));
-  if (mg_stat(path, &st) != 0 || (pd->file.fp = mg_fopen(path, "rb")) == NULL) {
-    int code, err = mg_get_errno();
-    switch (err) {
-      case EACCES:
-        code = 403;
-        break;
-      case ENOENT:
-        code = 404;
-        break;
-      default:
-        code = 500;
-    };
-    mg_http_send_error(nc, code, "Open failed");
-  } else {
-    char etag[50], current_time[50], last_modified[50], range[70];
-    time_t t = (time_t) mg_time();
-    int64_t r1 = 0, r2 = 0, cl = st.st_size;
-    struct mg_str *range_hdr = mg_get_http_header(hm, "Range");
-    int n, status_code = 200;
-
-    /* Handle Range header */
-    range[0] = '\0';
-    if (range_hdr != NULL &&
-        (n = mg_http_parse_range_header(range_hdr, &r1, &r2)) > 0 && r1 >= 0 &&
-        r2 >= 0) {
-      /* If range is specified like "400-", set second limit to content len */
-      if (n == 1) {
-        r2 = cl - 1;
-      }
-      if (r1 > r2 || r2 >= cl) {
-        status_code = 416;
-        cl = 0;
-        snprintf(range, sizeof(range),
-                 "Content-Range: bytes */%" INT64_FMT "\r\n",
-                 (int64_t) st.st_size);
-      } else {
-        status_code = 206;
-        cl = r2 - r1 + 1;
-        snprintf(range, sizeof(range),
-                 "Content-Range: bytes %" INT64_FMT "-%" INT64_FMT
-                 "/%" INT64_FMT "\r\n",
-                 r1, r1 + cl - 1, (int64_t) st.st_size);
-#if _FILE_OFFSET_BITS == 64 || _POSIX_C_SOURCE >= 200112L || \
-    _XOPEN_SOURCE >= 600
-        fseeko(pd->file.fp, r1, SEEK_SET);
-#else
-        fseek(pd->file.fp, (long) r1, SEEK_SET);
+  /* Drop whatever is left of a previous response on this connection */
+  mg_http_free_proto_data_file(&pd->file);
+#if MG_ENABLE_FILE_THREADS
+  if (nc->mgr->file_pool != NULL &&
+      mg_file_pool_open(nc, hm, path, mime_type, encoding, extra_headers)) {
+    return;
+  }
 #endif
-      }
+  if ((fp = mg_fopen(path, "rb")) == NULL) {
+    mg_http_send_open_error(nc, mg_get_errno());
+  } else if (mg_stat(path, &st) != 0) {
+    int err = mg_get_errno();
+    fclose(fp);
+    mg_http_send_open_error(nc, err);
+  } else {
+    mg_http_serve_opened_file(nc, hm, fp, &st, mime_type, encoding,
+                              extra_headers);
+  }
+}
+
+#if MG_ENABLE_FILE_THREADS
+/*
+ * File I/O threads. Jobs are queued by the manager's thread, run on a
+ * file thread, and put on the done list. The first job to land on an empty
+ * done list wakes the manager through its control socket, and
+ * mg_mgr_poll() then finishes all done jobs.
+ */
+static void mg_file_job_run(struct mg_file_job *job) {
+  if (job->kind == MG_FILE_JOB_OPEN) {
+    if ((job->fp = mg_fopen(job->path, "rb")) == NULL) {
+      job->err = mg_get_errno();
+    } else if (fstat(fileno(job->fp), &job->st) != 0) {
+      job->err = mg_get_errno();
+      fclose(job->fp);
+      job->fp = NULL;
     }
+  } else {
+    ssize_t n = pread(fileno(job->fp), job->buf, job->len, (off_t) job->offset);
+    job->n = n > 0 ? (size_t) n : 0;
+  }
+}
 
-#if !MG_DISABLE_HTTP_KEEP_ALIVE
-    {
-      struct mg_str *conn_hdr = mg_get_http_header(hm, "Connection");
-      if (conn_hdr != NULL) {
-        pd->file.keepalive = (mg_vcasecmp(conn_hdr, "keep-alive") == 0);
-      } else {
-        pd->file.keepalive = (mg_vcmp(&hm->proto, "HTTP/1.1") == 0);
-      }
+static void *mg_file_pool_thread(void *param) {
+  struct mg_file_pool *pool = (struct mg_file_pool *) param;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    struct mg_file_job *job;
+    int wake;
+    while (!pool->stop && pool->queue == NULL) {
+      pthread_cond_wait(&pool->cond, &pool->lock);
     }
-#endif
+    if (pool->stop) break;
+    job = pool->queue;
+    pool->queue = job->next;
+    if (pool->queue == NULL) pool->queue_tail = &pool->queue;
+    pthread_mutex_unlock(&pool->lock);
 
-    mg_http_construct_etag(etag, sizeof(etag), &st);
-    mg_gmt_time_string(current_time, sizeof(current_time), &t);
-    mg_gmt_time_string(last_modified, sizeof(last_modified), &st.st_mtime);
-    mg_send_response_line_s(nc, status_code, extra_headers);
-    mg_printf(nc,
-              "Date: %s\r\n"
-              "Last-Modified: %s\r\n"
-              "Accept-Ranges: bytes\r\n"
-              "Content-Type: %.*s\r\n"
-              "Connection: %s\r\n"
-              "Content-Length: %" SIZE_T_FMT
-              "\r\n"
-              "%s"
-              "Etag: %s\r\n",
-              current_time, last_modified, (int) mime_type.len, mime_type.p,
-              (pd->file.keepalive ? "keep-alive" : "close"), (size_t) cl, range,
-              etag);
-    if (encoding.len > 0) {
-      mg_printf(nc, "Content-Encoding: %.*s\r\n", (int) encoding.len,
-                encoding.p);
+    mg_file_job_run(job);
+
+    pthread_mutex_lock(&pool->lock);
+    job->next = NULL;
+    wake = (pool->done == NULL);
+    *pool->done_tail = job;
+    pool->done_tail = &job->next;
+    if (wake) {
+      pthread_mutex_unlock(&pool->lock);
+      mg_broadcast(pool->mgr, NULL, "", 1);
+      pthread_mutex_lock(&pool->lock);
     }
-    mg_send(nc, "\r\n", 2);
-    pd->file.cl = cl;
-    pd->file.type = DATA_FILE;
+  }
+  pool->alive--;
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+static int mg_file_pool_submit(struct mg_file_pool *pool,
+                               struct mg_file_job *job) {
+  int ok;
+  pthread_mutex_lock(&pool->lock);
+  ok = !pool->stop;
+  if (ok) {
+    job->next = NULL;
+    *pool->queue_tail = job;
+    pool->queue_tail = &job->next;
+    pthread_cond_signal(&pool->cond);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return ok;
+}
+
+static char *mg_file_job_copy(char *dst, struct mg_str src,
+                              struct mg_str *out) {
+  memcpy(dst, src.p, src.len);
+  dst[src.len] = '\0';
+  out->p = dst;
+  out->len = src.len;
+  return dst + src.len + 1;
+}
+
+MG_INTERNAL int mg_file_pool_open(struct mg_connection *nc,
+                                  struct http_message *hm, const char *path,
+                                  struct mg_str mime_type,
+                                  struct mg_str encoding,
+                                  struct mg_str extra_headers) {
+  struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
+  struct mg_str path_str = mg_mk_str(path), unused;
+  size_t size = sizeof(struct mg_file_job) + hm->message.len + path_str.len +
+                mime_type.len + encoding.len + extra_headers.len + 5;
+  struct mg_file_job *job = (struct mg_file_job *) MG_CALLOC(1, size);
+  char *p;
+  if (job == NULL) return 0;
+  job->nc = nc;
+  job->kind = MG_FILE_JOB_OPEN;
+  p = (char *) (job + 1);
+  p = mg_file_job_copy(p, hm->message, &job->message);
+  job->path = p;
+  p = mg_file_job_copy(p, path_str, &unused);
+  p = mg_file_job_copy(p, mime_type, &job->mime_type);
+  p = mg_file_job_copy(p, encoding, &job->encoding);
+  mg_file_job_copy(p, extra_headers, &job->extra_headers);
+  if (!mg_file_pool_submit(nc->mgr->file_pool, job)) {
+    MG_FREE(job);
+    return 0;
+  }
+  pd->file.job = job;
+  return 1;
+}
+
+MG_INTERNAL int mg_file_pool_read(struct mg_connection *nc, int64_t offset,
+                                  int64_t left) {
+  struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
+  size_t len = left > MG_FILE_READ_SIZE ? MG_FILE_READ_SIZE : (size_t) left;
+  struct mg_file_job *job =
+      (struct mg_file_job *) MG_CALLOC(1, sizeof(*job) + len);
+  if (job == NULL) return 0;
+  job->nc = nc;
+  job->kind = MG_FILE_JOB_READ;
+  job->fp = pd->file.fp;
+  job->offset = offset;
+  job->len = len;
+  job->buf = (char *) (job + 1);
+  if (!mg_file_pool_submit(nc->mgr->file_pool, job)) {
+    MG_FREE(job);
+    return 0;
+  }
+  pd->file.job = job;
+  return 1;
+}
+
+static void mg_file_job_finish(struct mg_file_job *job) {
+  struct mg_connection *nc = job->nc;
+  struct mg_http_proto_data *pd;
+  if (nc == NULL) {
+    if (job->fp != NULL) fclose(job->fp);
+    MG_FREE(job);
+    return;
+  }
+  pd = mg_http_get_proto_data(nc);
+  pd->file.job = NULL;
+  if (job->kind == MG_FILE_JOB_OPEN) {
+    struct http_message hm;
+    if (job->fp == NULL) {
+      mg_http_send_open_error(nc, job->err);
+    } else if (mg_parse_http(job->message.p, (int) job->message.len, &hm, 1) <=
+               0) {
+      fclose(job->fp);
+      mg_http_send_error(nc, 500, NULL);
+    } else {
+      mg_http_serve_opened_file(nc, &hm, job->fp, &job->st, job->mime_type,
+                                job->encoding, job->extra_headers);
+    }
+  } else if (job->n == 0) {
+    /* The file has shrunk under us, the response cannot be completed */
+    nc->flags |= MG_F_SEND_AND_CLOSE;
+    mg_http_free_proto_data_file(&pd->file);
+    pd->finished = 1;
+  } else {
+    mg_send(nc, job->buf, (int) job->n);
+    pd->file.range_sent += job->n;
+    pd->file.sent += job->n;
     mg_http_transfer_file_data(nc);
   }
+  MG_FREE(job);
+}
+
+MG_INTERNAL void mg_file_pool_complete(struct mg_mgr *mgr) {
+  struct mg_file_pool *pool = mgr->file_pool;
+  struct mg_file_job *job, *next;
+  if (pool == NULL) return;
+  pthread_mutex_lock(&pool->lock);
+  job = pool->done;
+  pool->done = NULL;
+  pool->done_tail = &pool->done;
+  pthread_mutex_unlock(&pool->lock);
+  for (; job != NULL; job = next) {
+    next = job->next;
+    mg_file_job_finish(job);
+  }
+}
+
+int mg_mgr_set_file_threads(struct mg_mgr *mgr, int num_threads) {
+  struct mg_file_pool *pool;
+  int i;
+  if (mgr->file_pool != NULL) return mgr->file_pool->num_threads;
+  if (num_threads <= 0 || mgr->ctl[0] == INVALID_SOCKET) return 0;
+  pool = (struct mg_file_pool *) MG_CALLOC(1, sizeof(*pool));
+  if (pool == NULL) return 0;
+  pool->threads = (pthread_t *) MG_CALLOC(num_threads, sizeof(pthread_t));
+  if (pool->threads == NULL) {
+    MG_FREE(pool);
+    return 0;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  pool->queue_tail = &pool->queue;
+  pool->done_tail = &pool->done;
+  pool->mgr = mgr;
+  for (i = 0; i < num_threads; i++) {
+    if (pthread_create(&pool->threads[i], NULL, mg_file_pool_thread, pool) !=
+        0) {
+      break;
+    }
+    pool->num_threads++;
+  }
+  pool->alive = pool->num_threads;
+  if (pool->num_threads == 0) {
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    MG_FREE(pool->threads);
+    MG_FREE(pool);
+    return 0;
+  }
+  mgr->file_pool = pool;
+  return pool->num_threads;
 }
 
+MG_INTERNAL void mg_file_pool_free(struct mg_mgr *mgr) {
+  struct mg_file_pool *pool = mgr->file_pool;
+  struct mg_file_job *job;
+  int i, alive;
+  if (pool == NULL) return;
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  /* Threads may be waiting in mg_broadcast() for the manager to answer */
+  do {
+    mg_mgr_poll(mgr, 1);
+    pthread_mutex_lock(&pool->lock);
+    alive = pool->alive;
+    pthread_mutex_unlock(&pool->lock);
+  } while (alive > 0);
+  for (i = 0; i < pool->num_threads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  /* Jobs that never ran fail, like reads from a truncated file */
+  while ((job = pool->queue) != NULL) {
+    pool->queue = job->next;
+    job->err = EIO;
+    job->next = NULL;
+    *pool->done_tail = job;
+    pool->done_tail = &job->next;
+  }
+  pool->queue_tail = &pool->queue;
+  mg_file_pool_complete(mgr);
+  mgr->file_pool = NULL;
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->cond);
+  MG_FREE(pool->threads);
+  MG_FREE(pool);
+}
+#endif /* MG_ENABLE_FILE_THREADS */
+
 void mg_http_serve_file(struct mg_connection *nc, struct http_message *hm,
                         const char *path, const struct mg_str mime_type,
                         const struct mg_str extra_headers) {
@@ -8226,7 +8863,7 @@ static int mg_num_leap_years(int year) {
 }
 
 /* Parse UTC date-time string, and return the corresponding time_t value. */
-MG_INTERNAL time_t mg_parse_date_string(const char *datetime) {
+time_t mg_parse_date_string(const char *datetime) {
   static const unsigned short days_before_month[] = {
       0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
   char month_str[32];
@@ -8251,7 +8888,7 @@ MG_INTERNAL time_t mg_parse_date_string(const char *datetime) {
   return result;
 }
 
-MG_INTERNAL int mg_is_not_modified(struct http_message *hm, cs_stat_t *st) {
+int mg_is_not_modified(struct http_message *hm, cs_stat_t *st) {
   struct mg_str *hdr;
   if ((hdr = mg_get_http_header(hm, "If-None-Match")) != NULL) {
     char etag[64];
@@ -9832,6 +10469,100 @@ MG_INTERNAL void mg_handle_put(struct mg_connection *nc, const char *path,
 #define FLAGS_MASK_FIN (1 << 7)
 #define FLAGS_MASK_OP 0x0f
 
+#if MG_ENABLE_WS_SIMD && \
+    (defined(__SSE2__) || defined(_M_X64) || \
+     (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define MG_WS_MASK_SSE2 1
+#include <emmintrin.h>
+#endif
+#if MG_ENABLE_WS_SIMD && defined(__AVX2__)
+#define MG_WS_MASK_AVX2 1
+#include <immintrin.h>
+#endif
+
+/*
+ * (Un)masking XORs the payload with a 4-byte key. The kernels below mask
+ * bytes one at a time until `p` is aligned to their width, then go on with
+ * the key rotated to match, and leave the rest to the word loop.
+ */
+static size_t mg_ws_mask_head(unsigned char *p, size_t len,
+                              const unsigned char mask[4], size_t width,
+                              uint32_t *key) {
+  unsigned char rotated[4];
+  size_t i, head = (width - ((uintptr_t) p & (width - 1))) & (width - 1);
+  if (head > len) head = len;
+  for (i = 0; i < head; i++) p[i] ^= mask[i & 3];
+  for (i = 0; i < 4; i++) rotated[i] = mask[(head + i) & 3];
+  memcpy(key, rotated, sizeof(*key));
+  return head;
+}
+
+static void mg_ws_mask_tail(unsigned char *p, size_t i, size_t len,
+                            const unsigned char mask[4], uint32_t key) {
+  uint64_t key64 = ((uint64_t) key << 32) | key, v;
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&v, p + i, sizeof(v));
+    v ^= key64;
+    memcpy(p + i, &v, sizeof(v));
+  }
+  for (; i < len; i++) p[i] ^= mask[i & 3];
+}
+
+static void mg_ws_mask_words(unsigned char *p, size_t len,
+                             const unsigned char mask[4]) {
+  uint32_t key;
+  size_t i = mg_ws_mask_head(p, len, mask, 8, &key);
+  mg_ws_mask_tail(p, i, len, mask, key);
+}
+
+#ifdef MG_WS_MASK_SSE2
+static void mg_ws_mask_sse2(unsigned char *p, size_t len,
+                            const unsigned char mask[4]) {
+  uint32_t key;
+  size_t i = mg_ws_mask_head(p, len, mask, 16, &key);
+  __m128i k = _mm_set1_epi32((int) key);
+  for (; i + 16 <= len; i += 16) {
+    __m128i *q = (__m128i *) (p + i);
+    _mm_store_si128(q, _mm_xor_si128(_mm_load_si128(q), k));
+  }
+  mg_ws_mask_tail(p, i, len, mask, key);
+}
+#endif
+
+#ifdef MG_WS_MASK_AVX2
+static void mg_ws_mask_avx2(unsigned char *p, size_t len,
+                            const unsigned char mask[4]) {
+  uint32_t key;
+  size_t i = mg_ws_mask_head(p, len, mask, 32, &key);
+  __m256i k = _mm256_set1_epi32((int) key);
+  for (; i + 32 <= len; i += 32) {
+    __m256i *q = (__m256i *) (p + i);
+    _mm256_store_si256(q, _mm256_xor_si256(_mm256_load_si256(q), k));
+  }
+  mg_ws_mask_tail(p, i, len, mask, key);
+}
+#endif
+
+/*
+ * XOR `len` bytes at `p` with `mask`, starting from the first mask byte.
+ * Short payloads skip the vector kernels, whose aligning head would be most
+ * of the work.
+ */
+static void mg_ws_mask(unsigned char *p, size_t len,
+                       const unsigned char mask[4]) {
+  if (len < 64) {
+    mg_ws_mask_words(p, len, mask);
+    return;
+  }
+#if defined(MG_WS_MASK_AVX2)
+  mg_ws_mask_avx2(p, len, mask);
+#elif defined(MG_WS_MASK_SSE2)
+  mg_ws_mask_sse2(p, len, mask);
+#else
+  mg_ws_mask_words(p, len, mask);
+#endif
+}
+
 static int mg_is_ws_fragment(unsigned char flags) {
   return (flags & FLAGS_MASK_FIN) == 0 ||
          (flags & FLAGS_MASK_OP) == WEBSOCKET_OP_CONTINUE;
@@ -9877,7 +10608,7 @@ static void mg_ws_close(struct mg_connection *nc, const void *data,
 
 static int mg_deliver_websocket_data(struct mg_connection *nc) {
   /* Using unsigned char *, cause of integer arithmetic below */
-  uint64_t i, data_len = 0, frame_len = 0, new_data_len = nc->recv_mbuf.len,
+  uint64_t data_len = 0, frame_len = 0, new_data_len = nc->recv_mbuf.len,
               len, mask_len = 0, header_len = 0;
   struct mg_ws_proto_data *wsd = mg_ws_get_proto_data(nc);
   unsigned char *new_data = (unsigned char *) nc->recv_mbuf.buf,
@@ -9961,9 +10692,9 @@ static int mg_deliver_websocket_data(struct mg_connection *nc) {
 
     /* Apply mask if necessary */
     if (mask_len > 0) {
-      for (i = 0; i < data_len; i++) {
-        new_data[i + header_len] ^= (new_data + header_len - mask_len)[i % 4];
-      }
+      unsigned char mask[4];
+      memcpy(mask, new_data + header_len - mask_len, sizeof(mask));
+      mg_ws_mask(new_data + header_len, (size_t) data_len, mask);
     }
 
     if (reass) {
@@ -10100,11 +10831,9 @@ static void mg_send_ws_header(struct mg_connection *nc, int op, size_t len,
 }
 
 static void mg_ws_mask_frame(struct mbuf *mbuf, struct ws_mask_ctx *ctx) {
-  size_t i;
   if (ctx->pos == 0) return;
-  for (i = 0; i < (mbuf->len - ctx->pos); i++) {
-    mbuf->buf[ctx->pos + i] ^= ((char *) &ctx->mask)[i % 4];
-  }
+  mg_ws_mask((unsigned char *) mbuf->buf + ctx->pos, mbuf->len - ctx->pos,
+             (unsigned char *) &ctx->mask);
 }
 
 void mg_send_websocket_frame(struct mg_connection *nc, int op, const void *data,
@@ -370,6 +370,11 @@ unsigned int sleep(unsigned int seconds);
 #define _XOPEN_SOURCE 600
 #endif
 
+/* For accept4() */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 /* <inttypes.h> wants this for C++ */
 #ifndef __STDC_FORMAT_MACROS
 #define __STDC_FORMAT_MACROS
@@ -3191,6 +3196,14 @@ struct {								\
 #define MG_ENABLE_FILESYSTEM 0
 #endif
 
+#ifndef MG_ENABLE_FILE_THREADS
+#if MG_ENABLE_FILESYSTEM && MG_ENABLE_BROADCAST && !defined(_WIN32)
+#define MG_ENABLE_FILE_THREADS 1
+#else
+#define MG_ENABLE_FILE_THREADS 0
+#endif
+#endif
+
 #ifndef MG_ENABLE_GETADDRINFO
 #define MG_ENABLE_GETADDRINFO 0
 #endif
@@ -3227,6 +3240,14 @@ struct {								\
 #define MG_ENABLE_HTTP_WEBSOCKET MG_ENABLE_HTTP
 #endif
 
+/*
+ * Use SSE2 / AVX2 to (un)mask websocket payloads when the compiler targets
+ * them. Word-wide masking is used otherwise.
+ */
+#ifndef MG_ENABLE_WS_SIMD
+#define MG_ENABLE_WS_SIMD 1
+#endif
+
 #ifndef MG_ENABLE_IPV6
 #define MG_ENABLE_IPV6 0
 #endif
@@ -3566,12 +3587,19 @@ struct mg_mgr {
 #endif
 #if MG_ENABLE_BROADCAST
   sock_t ctl[2]; /* Socketpair for mg_broadcast() */
+#endif
+#if MG_ENABLE_FILE_THREADS
+  struct mg_file_pool *file_pool; /* See mg_mgr_set_file_threads() */
 #endif
   void *user_data; /* User data */
   int num_ifaces;
   int num_calls;
   struct mg_iface **ifaces; /* network interfaces */
   const char *nameserver;   /* DNS server to use */
+  int accept_budget; /* Max accepts per readable listener, 0 means 1 */
+  int accept_cap;    /* Max accepts per mg_mgr_poll() call, 0 for no cap */
+  int num_accepted;  /* Accepted so far in the current mg_mgr_poll() call */
+  int eager_send;    /* Write replies right after the read that made them */
 };
 
 /*
@@ -4389,6 +4417,28 @@ extern "C" {
 #define MG_MAX_HTTP_SEND_MBUF 1024
 #endif
 
+/*
+ * When enabled, file bodies are written with sendfile() whenever the send
+ * buffer is empty, instead of being copied through it.
+ */
+#ifndef MG_ENABLE_SENDFILE
+#ifdef __linux__
+#define MG_ENABLE_SENDFILE 1
+#else
+#define MG_ENABLE_SENDFILE 0
+#endif
+#endif
+
+/* Size of each read done by a file I/O thread */
+#ifndef MG_FILE_READ_SIZE
+#define MG_FILE_READ_SIZE 65536
+#endif
+
+/* Most ranges accepted in a single Range request header */
+#ifndef MG_MAX_HTTP_RANGES
+#define MG_MAX_HTTP_RANGES 16
+#endif
+
 #ifndef MG_CGI_ENVIRONMENT_SIZE
 #define MG_CGI_ENVIRONMENT_SIZE 8192
 #endif
@@ -5071,6 +5121,11 @@ void mg_serve_http(struct mg_connection *nc, struct http_message *hm,
 /*
  * Serves a specific file with a given MIME type and optional extra headers.
  *
+ * Range requests are answered with 206, using a multipart/byteranges body
+ * when several ranges are asked for, or with 416 when no range can be
+ * satisfied. A Range header is ignored when an If-Range header does not
+ * match the file's entity tag or modification date.
+ *
  * Example code snippet:
  *
  * ```c
@@ -5091,6 +5146,60 @@ void mg_http_serve_file(struct mg_connection *nc, struct http_message *hm,
                         const char *path, const struct mg_str mime_type,
                         const struct mg_str extra_headers);
 
+/*
+ * Looks up the MIME type for `path` using `opts->custom_mime_types` and the
+ * builtin extension table. For precompressed files like `app.js.gz`,
+ * `type` is set to the type of the uncompressed file and `encoding` to
+ * "gzip".
+ *
+ * Returns 1 if a type was found, 0 otherwise.
+ */
+int mg_get_mime_type_encoding(struct mg_str path, struct mg_str *type,
+                              struct mg_str *encoding,
+                              const struct mg_serve_http_opts *opts);
+
+/*
+ * Like `mg_http_serve_file()`, but also sets the Content-Encoding header
+ * when `encoding` is not empty. `path` must already be resolved, no index
+ * file or directory handling is done.
+ */
+void mg_http_serve_file_internal(struct mg_connection *nc,
+                                 struct http_message *hm, const char *path,
+                                 struct mg_str mime_type,
+                                 struct mg_str encoding,
+                                 struct mg_str extra_headers);
+
+/*
+ * Checks the request's If-None-Match and If-Modified-Since headers against
+ * the file described by `st`. Returns 1 if a 304 response can be sent.
+ */
+int mg_is_not_modified(struct http_message *hm, cs_stat_t *st);
+
+#if MG_ENABLE_FILE_THREADS
+/*
+ * Starts `num_threads` threads that open, stat and read files served by
+ * `mg_http_serve_file()` and `mg_serve_http()`, so that a slow disk does not
+ * stall the event loop. Results are handed back through the manager's
+ * control socket and processed by `mg_mgr_poll()`. The threads are stopped
+ * by `mg_mgr_free()`. Can only be called once per manager.
+ *
+ * Returns the number of threads started.
+ */
+int mg_mgr_set_file_threads(struct mg_mgr *mgr, int num_threads);
+#endif
+
+/*
+ * Writes the quoted entity tag of the file described by `st` to `buf`. The
+ * tag is built from the inode, modification time and size.
+ */
+void mg_http_construct_etag(char *buf, size_t buf_len, const cs_stat_t *st);
+
+/*
+ * Parses an HTTP date, as found in If-Modified-Since. Returns 0 if the
+ * date cannot be parsed.
+ */
+time_t mg_parse_date_string(const char *datetime);
+
 #if MG_ENABLE_HTTP_STREAMING_MULTIPART
 
 /* Callback prototype for `mg_file_upload_handler()`. */
@@ -5223,6 +5332,12 @@ void mg_send_http_chunk(struct mg_connection *nc, const char *buf, size_t len);
  */
 void mg_printf_http_chunk(struct mg_connection *nc, const char *fmt, ...);
 
+/*
+ * Returns the reason phrase for an HTTP status code, or "OK" for codes it
+ * does not know.
+ */
+const char *mg_status_message(int status_code);
+
 /*
  * Sends the response status line.
  * If `extra_headers` is not NULL, then `extra_headers` are also sent